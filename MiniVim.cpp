@@ -6,352 +6,6279 @@
 #include <sstream>
 #include <algorithm>
 #include <stack>
+#include <map>
+#include <unordered_set>
+#include <unordered_map>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <dirent.h>
+#include <spawn.h>
 using namespace std;
 
-class MiniVim {
+// 行缓冲区：按块存储文本行，块与块索引都采用写时复制（copy-on-write）。
+// 复制一个LineBuffer只复制根指针（O(1)），之后谁先修改谁才复制被修改的那一块，
+// 因此后台保存、撤销栈都可以直接持有快照而不必拷贝全部行。
+class LineBuffer {
+    struct Index;
 public:
-    // 构造函数，初始化MiniVim对象
-    MiniVim(const vector<string>& filenames)
-    : cursor_x(0), cursor_y(0), top_line(0), left_column(0), insert_mode_active(false), command_mode_active(false) {
-        file_history = filenames;
-        current_file_index = 0;  // 默认加载第一个文件
-        loadFile();               // 加载第一个文件
+    typedef vector<string> Chunk;
+    static const size_t CHUNK_LINES = 512;  // 每块的目标行数
+
+    LineBuffer() : root(make_shared<Index>()), tick(next_tick()) {}
+
+    size_t size() const { return root->total; }
+    bool empty() const { return root->total == 0; }
+    // 内容版本号：每次修改都会取一个全局唯一的新值，快照保留修改时的值
+    unsigned long version() const { return tick; }
+
+    // 只读访问
+    const string& operator[](size_t i) const {
+        size_t k = find_chunk(i);
+        return (*root->chunks[k])[i - root->starts[k]];
     }
 
-    // 析构函数，结束ncurses模式
-    ~MiniVim() { endwin(); }
+    // 写访问，必要时先复制被共享的索引和块
+    string& mut(size_t i) {
+        touch();
+        size_t k = find_chunk(i);
+        return own_chunk(k)[i - root->starts[k]];
+    }
 
-    // 主循环，处理用户输入和界面更新
-    void run() {
+    void push_back(string line) { insert(size(), std::move(line)); }
+
+    // 在第pos行之前插入一行
+    void insert(size_t pos, string line) {
+        touch();
+        Index& idx = *root;
+        if (idx.chunks.empty()) {
+            idx.chunks.push_back(make_shared<Chunk>());
+            idx.starts.push_back(0);
+        }
+        size_t k = (pos == idx.total) ? idx.chunks.size() - 1 : find_chunk(pos);
+        Chunk& chunk = own_chunk(k);
+        chunk.insert(chunk.begin() + (pos - idx.starts[k]), std::move(line));
+        ++idx.total;
+        if (chunk.size() > 2 * CHUNK_LINES) split_chunk(k);
+        reindex(k + 1);
+    }
+
+    // 删除第pos行
+    void erase(size_t pos) {
+        touch();
+        Index& idx = *root;
+        size_t k = find_chunk(pos);
+        Chunk& chunk = own_chunk(k);
+        chunk.erase(chunk.begin() + (pos - idx.starts[k]));
+        --idx.total;
+        if (chunk.empty()) {
+            idx.chunks.erase(idx.chunks.begin() + k);
+            idx.starts.erase(idx.starts.begin() + k);
+        }
+        reindex(k);
+    }
+
+    // 删除[first, last)范围内的行：被整块覆盖的块直接丢弃，只有两端的块需要修改
+    void erase(size_t first, size_t last) {
+        if (first >= last) return;
+        touch();
+        Index& idx = *root;
+        size_t k = find_chunk(first), off = first - idx.starts[k];
+        size_t k_last = find_chunk(last - 1), off_last = last - idx.starts[k_last];
+        if (k == k_last) {
+            Chunk& chunk = own_chunk(k);
+            chunk.erase(chunk.begin() + off, chunk.begin() + off_last);
+        } else {
+            Chunk& tail = own_chunk(k_last);
+            tail.erase(tail.begin(), tail.begin() + off_last);
+            Chunk& head = own_chunk(k);
+            head.erase(head.begin() + off, head.end());
+            idx.chunks.erase(idx.chunks.begin() + k + 1, idx.chunks.begin() + k_last);
+            idx.starts.erase(idx.starts.begin() + k + 1, idx.starts.begin() + k_last);
+            if (idx.chunks[k + 1]->empty()) drop_chunk(k + 1);
+        }
+        idx.total -= last - first;
+        if (idx.chunks[k]->empty()) drop_chunk(k);
+        reindex(k);
+        merge_small(k);
+        if (k > 0) merge_small(k - 1);
+    }
+
+    // 在第pos行之前一次插入多行
+    void insert(size_t pos, vector<string> new_lines) {
+        if (new_lines.empty()) return;
+        touch();
+        Index& idx = *root;
+        size_t k = split_at(pos);
+        vector<shared_ptr<Chunk>> fresh;
+        for (size_t i = 0; i < new_lines.size(); i += CHUNK_LINES) {
+            size_t end = min(new_lines.size(), i + CHUNK_LINES);
+            fresh.push_back(make_shared<Chunk>(make_move_iterator(new_lines.begin() + i),
+                                               make_move_iterator(new_lines.begin() + end)));
+        }
+        idx.chunks.insert(idx.chunks.begin() + k, fresh.begin(), fresh.end());
+        idx.starts.insert(idx.starts.begin() + k, fresh.size(), 0);
+        idx.total += new_lines.size();
+        reindex(k);
+        merge_small(k + fresh.size() - 1);
+        if (k > 0) merge_small(k - 1);
+    }
+
+    // 在第pos行之前插入另一个缓冲区的全部行：直接共享对方的块，不复制行内容
+    void splice(size_t pos, LineBuffer other) {
+        if (other.empty()) return;
+        touch();
+        Index& idx = *root;
+        const vector<shared_ptr<Chunk>>& chunks = other.root->chunks;
+        size_t k = split_at(pos);
+        idx.chunks.insert(idx.chunks.begin() + k, chunks.begin(), chunks.end());
+        idx.starts.insert(idx.starts.begin() + k, chunks.size(), 0);
+        idx.total += other.size();
+        reindex(k);
+        merge_small(k + chunks.size() - 1);
+        if (k > 0) merge_small(k - 1);
+    }
+
+    void append(const LineBuffer& other) { splice(size(), other); }
+
+    // 用new_lines替换[first, last)范围内的行
+    void replace(size_t first, size_t last, vector<string> new_lines) {
+        erase(first, last);
+        insert(first, std::move(new_lines));
+    }
+
+    // 删除所有drop[i]非零的行，整个缓冲区只扫描一遍：不含被删行的块原样保留（仍与快照共享），
+    // 其余块只复制留下的行，过小的相邻新块顺手合并
+    void erase_marked(const vector<char>& drop) {
+        touch();
+        Index& idx = *root;
+        vector<shared_ptr<Chunk>> kept;
+        bool last_fresh = false;  // kept的最后一块是否为本次新建
+        for (size_t k = 0; k < idx.chunks.size(); ++k) {
+            shared_ptr<Chunk>& chunk = idx.chunks[k];
+            auto first = drop.begin() + idx.starts[k], last = first + chunk->size();
+            if (all_of(first, last, [](char d) { return d == 0; })) {
+                kept.push_back(chunk);
+                last_fresh = false;
+                continue;
+            }
+            bool owned = chunk.use_count() == 1;  // 独占时移动行内容，否则复制
+            size_t remaining = count(first, last, 0);
+            if (!last_fresh || kept.back()->size() + remaining > CHUNK_LINES) {
+                if (remaining == 0) continue;
+                kept.push_back(make_shared<Chunk>());
+                kept.back()->reserve(remaining);
+                last_fresh = true;
+            }
+            Chunk& out = *kept.back();
+            for (size_t i = 0; i < chunk->size(); ++i) {
+                if (first[i]) continue;
+                out.push_back(owned ? std::move((*chunk)[i]) : (*chunk)[i]);
+            }
+        }
+        idx.chunks = std::move(kept);
+        idx.starts.assign(idx.chunks.size(), 0);
+        idx.total = 0;
+        for (const auto& chunk : idx.chunks) idx.total += chunk->size();
+        reindex(0);
+    }
+
+    // 取[first, last)范围内的行组成新缓冲区：完整的块共享，只复制两端不完整的块
+    LineBuffer slice(size_t first, size_t last) const {
+        LineBuffer out;
+        Index& dst = *out.root;
+        for (size_t pos = first, k = first < last ? find_chunk(first) : 0; pos < last; ++k) {
+            const shared_ptr<Chunk>& chunk = root->chunks[k];
+            size_t begin = pos - root->starts[k];
+            size_t end = min(chunk->size(), last - root->starts[k]);
+            if (begin == 0 && end == chunk->size()) {
+                dst.chunks.push_back(chunk);
+            } else {
+                dst.chunks.push_back(make_shared<Chunk>(chunk->begin() + begin, chunk->begin() + end));
+            }
+            dst.starts.push_back(pos - first);
+            pos += end - begin;
+        }
+        dst.total = last > first ? last - first : 0;
+        return out;
+    }
+
+    void clear() {
+        root = make_shared<Index>();
+        tick = next_tick();
+    }
+
+    // 与另一个缓冲区比较，得到开头相同的行数head和结尾相同的行数tail（head + tail不超过较短者的行数）。
+    // 两边共享的块直接跳过，只有不同的块才逐行比较，所以代价只与修改过的块有关
+    void common_affixes(const LineBuffer& other, size_t& head, size_t& tail) const {
+        const Index& a = *root;
+        const Index& b = *other.root;
+        size_t limit = min(a.total, b.total);
+        head = 0;
+        for (size_t k = 0; k < a.chunks.size() && k < b.chunks.size() && a.chunks[k] == b.chunks[k]; ++k) {
+            head += a.chunks[k]->size();
+        }
+        while (head < limit && (*this)[head] == other[head]) ++head;
+        tail = 0;
+        for (size_t ka = a.chunks.size(), kb = b.chunks.size(); ka > 0 && kb > 0 && a.chunks[ka - 1] == b.chunks[kb - 1]; --ka, --kb) {
+            if (tail + a.chunks[ka - 1]->size() > limit - head) break;
+            tail += a.chunks[ka - 1]->size();
+        }
+        while (tail < limit - head && (*this)[a.total - 1 - tail] == other[b.total - 1 - tail]) ++tail;
+    }
+
+    // 估计不与other共享的块占用的内存（每行的string加上内容），即在other之外保留这份快照的额外开销
+    size_t unshared_bytes(const LineBuffer& other) const {
+        if (root == other.root) return 0;
+        unordered_set<const Chunk*> shared;
+        for (const auto& chunk : other.root->chunks) shared.insert(chunk.get());
+        size_t bytes = root->chunks.size() * (sizeof(shared_ptr<Chunk>) + sizeof(size_t));
+        for (const auto& chunk : root->chunks) {
+            if (shared.count(chunk.get())) continue;
+            for (const string& line : *chunk) bytes += sizeof(string) + line.size();
+        }
+        return bytes;
+    }
+
+    // 顺序遍历用的只读迭代器（遍历期间缓冲区不得修改）
+    class const_iterator {
+    public:
+        const string& operator*() const { return (*idx->chunks[k])[off]; }
+        const_iterator& operator++() {
+            if (++off >= idx->chunks[k]->size()) { ++k; off = 0; }
+            return *this;
+        }
+        bool operator!=(const const_iterator& other) const { return k != other.k || off != other.off; }
+    private:
+        friend class LineBuffer;
+        const Index* idx;
+        size_t k, off;
+    };
+
+    const_iterator begin() const { return make_iterator(0); }
+    const_iterator end() const { return make_iterator(root->chunks.size()); }
+    // 指向第i行的迭代器
+    const_iterator at(size_t i) const {
+        if (i >= root->total) return end();
+        const_iterator it = make_iterator(find_chunk(i));
+        it.off = i - root->starts[it.k];
+        return it;
+    }
+
+private:
+    struct Index {
+        vector<shared_ptr<Chunk>> chunks;  // 各块
+        vector<size_t> starts;             // 每块第一行的行号
+        size_t total = 0;                  // 总行数
+    };
+    shared_ptr<Index> root;
+    unsigned long tick;
+
+    static unsigned long next_tick() {
+        static atomic<unsigned long> counter(0);
+        return ++counter;
+    }
+
+    const_iterator make_iterator(size_t k) const {
+        const_iterator it;
+        it.idx = root.get();
+        it.k = k;
+        it.off = 0;
+        return it;
+    }
+
+    // 找到包含第i行的块
+    size_t find_chunk(size_t i) const {
+        const vector<size_t>& starts = root->starts;
+        return upper_bound(starts.begin(), starts.end(), i) - starts.begin() - 1;
+    }
+
+    // 修改前调用：更新版本号，索引被快照共享时先复制索引
+    void touch() {
+        tick = next_tick();
+        if (root.use_count() > 1) root = make_shared<Index>(*root);
+    }
+
+    // 取得第k块的独占副本
+    Chunk& own_chunk(size_t k) {
+        shared_ptr<Chunk>& chunk = root->chunks[k];
+        if (chunk.use_count() > 1) chunk = make_shared<Chunk>(*chunk);
+        return *chunk;
+    }
+
+    // 确保第pos行是某一块的开头，返回该块的下标（pos为总行数时返回块数）
+    size_t split_at(size_t pos) {
+        Index& idx = *root;
+        if (pos >= idx.total) return idx.chunks.size();
+        size_t k = find_chunk(pos), off = pos - idx.starts[k];
+        if (off == 0) return k;
+        Chunk& chunk = own_chunk(k);
+        auto tail = make_shared<Chunk>(make_move_iterator(chunk.begin() + off), make_move_iterator(chunk.end()));
+        chunk.resize(off);
+        idx.chunks.insert(idx.chunks.begin() + k + 1, tail);
+        idx.starts.insert(idx.starts.begin() + k + 1, pos);
+        return k + 1;
+    }
+
+    // 移除第k块（调用者负责reindex）
+    void drop_chunk(size_t k) {
+        root->chunks.erase(root->chunks.begin() + k);
+        root->starts.erase(root->starts.begin() + k);
+    }
+
+    // 第k块与下一块合起来不超过一块的目标大小时合并，避免范围操作后留下大量碎块
+    void merge_small(size_t k) {
+        Index& idx = *root;
+        if (k + 1 >= idx.chunks.size()) return;
+        if (idx.chunks[k]->size() + idx.chunks[k + 1]->size() > CHUNK_LINES) return;
+        Chunk& chunk = own_chunk(k);
+        const Chunk& next = *idx.chunks[k + 1];
+        chunk.insert(chunk.end(), next.begin(), next.end());
+        drop_chunk(k + 1);
+    }
+
+    // 把过大的块对半拆分
+    void split_chunk(size_t k) {
+        Index& idx = *root;
+        Chunk& chunk = *idx.chunks[k];
+        size_t half = chunk.size() / 2;
+        auto tail = make_shared<Chunk>(make_move_iterator(chunk.begin() + half), make_move_iterator(chunk.end()));
+        chunk.resize(half);
+        idx.chunks.insert(idx.chunks.begin() + k + 1, tail);
+        idx.starts.insert(idx.starts.begin() + k + 1, 0);
+    }
+
+    // 从第from块开始重新计算每块的起始行号
+    void reindex(size_t from) {
+        Index& idx = *root;
+        if (!idx.starts.empty()) idx.starts[0] = 0;
+        for (size_t k = max<size_t>(from, 1); k < idx.chunks.size(); ++k) {
+            idx.starts[k] = idx.starts[k - 1] + idx.chunks[k - 1]->size();
+        }
+    }
+};
+
+// 线程池（工作窃取）：每个工作线程有自己的任务队列，任务按轮转分配到各队列；
+// 线程从自己队列的头部取任务，自己的队列空了就从其他队列的尾部窃取，耗时不均的任务也能分摊到所有线程。
+// wait()等待已提交的任务全部完成，析构时同样会先执行完剩余任务
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads = 0) {
+        if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+        for (size_t i = 0; i < threads; ++i) {
+            queues.push_back(make_unique<TaskQueue>());
+        }
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([this, i]() { work(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(state_mutex);
+            stopping = true;
+        }
+        task_ready.notify_all();
+        for (thread& worker : workers) worker.join();
+    }
+
+    void submit(function<void()> task) {
+        TaskQueue& queue = *queues[next_queue++ % queues.size()];
+        {
+            lock_guard<mutex> lock(queue.lock);
+            queue.tasks.push_back(std::move(task));
+        }
+        {
+            lock_guard<mutex> lock(state_mutex);
+            ++queued;
+            ++unfinished;
+        }
+        task_ready.notify_one();
+    }
+
+    // 等待已提交的任务全部完成
+    void wait() {
+        unique_lock<mutex> lock(state_mutex);
+        all_done.wait(lock, [this]() { return unfinished == 0; });
+    }
+
+    size_t size() const { return workers.size(); }
+
+private:
+    struct TaskQueue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+    vector<unique_ptr<TaskQueue>> queues;
+    vector<thread> workers;
+    atomic<size_t> next_queue{0};
+    mutex state_mutex;
+    condition_variable task_ready, all_done;
+    size_t queued = 0;      // 队列中尚未取走的任务数
+    size_t unfinished = 0;  // 尚未执行完的任务数
+    bool stopping = false;
+
+    // 取一个任务：先取自己队列的头部，再依次从其他队列的尾部窃取
+    bool take_task(size_t self, function<void()>& task) {
+        for (size_t n = 0; n < queues.size(); ++n) {
+            TaskQueue& queue = *queues[(self + n) % queues.size()];
+            lock_guard<mutex> lock(queue.lock);
+            if (queue.tasks.empty()) continue;
+            if (n == 0) {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            } else {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void work(size_t self) {
+        while (true) {
+            {
+                unique_lock<mutex> lock(state_mutex);
+                task_ready.wait(lock, [this]() { return stopping || queued > 0; });
+                if (queued == 0) return;  // 已停止且没有剩余任务
+                --queued;
+            }
+            function<void()> task;
+            while (!take_task(self, task)) this_thread::yield();  // 任务已计入queued，正在入队
+            task();
+            lock_guard<mutex> lock(state_mutex);
+            if (--unfinished == 0) all_done.notify_all();
+        }
+    }
+};
+
+// 事件循环：主线程用poll()同时等待终端输入、eventfd（其他线程投递的任务）、timerfd（下一个需要醒来的时刻）
+// 和inotify（打开的文件在磁盘上被修改）。其他线程用post()把任务放入无锁的多生产者单消费者队列并写eventfd唤醒主线程，
+// 任务只在主线程中执行，可以直接修改编辑器状态而不用加锁。没有事件时poll()一直阻塞，空闲时不占CPU
+class EventLoop {
+public:
+    function<void(const string&)> on_file_change;  // 被监视的文件写完或被替换时调用，参数为watch()时的路径
+
+    EventLoop() {
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    }
+
+    ~EventLoop() {
+        for (Task* task = posted.exchange(nullptr); task; ) {  // 没来得及执行的任务直接丢弃
+            Task* next = task->next;
+            delete task;
+            task = next;
+        }
+        for (int fd : {wake_fd, timer_fd, notify_fd}) {
+            if (fd >= 0) close(fd);
+        }
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // 投递任务（任何线程都可以调用）：用CAS压入栈顶，主线程一次取走整个栈后反转为投递顺序
+    void post(function<void()> fn) {
+        Task* task = new Task{std::move(fn), posted.load(memory_order_relaxed)};
+        while (!posted.compare_exchange_weak(task->next, task, memory_order_release, memory_order_relaxed)) {}
+        uint64_t one = 1;
+        if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0) {}  // 计数已非零时写失败也能唤醒
+    }
+
+    // 在主线程中按投递顺序执行已投递的任务，没有任务时返回false
+    bool run_posted() {
+        Task* task = posted.exchange(nullptr, memory_order_acquire);
+        if (!task) return false;
+        Task* ordered = nullptr;
+        while (task) {
+            Task* next = task->next;
+            task->next = ordered;
+            ordered = task;
+            task = next;
+        }
+        while (ordered) {
+            Task* next = ordered->next;
+            ordered->fn();
+            delete ordered;
+            ordered = next;
+        }
+        return true;
+    }
+
+    // 监视文件。保存时常先写临时文件再改名，文件的inode会被换掉，所以监视文件所在的目录，
+    // 按文件名过滤写完（IN_CLOSE_WRITE）和改名到此（IN_MOVED_TO）两种事件
+    void watch(const string& path) {
+        for (const Watch& w : watches) {
+            if (w.path == path) return;
+        }
+        if (notify_fd < 0) notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (notify_fd < 0) return;
+        size_t slash = path.rfind('/');
+        string dir = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        int wd = inotify_add_watch(notify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd >= 0) watches.push_back({wd, slash == string::npos ? path : path.substr(slash + 1), path});
+    }
+
+    // 关注文件描述符：可读（或对端关闭）时在主线程中调用callback（例如服务器模式的套接字）
+    void add_reader(int fd, function<void()> callback) {
+        readers.push_back({fd, make_shared<function<void()>>(std::move(callback))});
+    }
+
+    // 不再关注fd，可以在fd自己的callback中调用
+    void remove_reader(int fd) {
+        readers.erase(remove_if(readers.begin(), readers.end(), [fd](const Reader& r) { return r.fd == fd; }), readers.end());
+    }
+
+    // 等待终端输入、到达deadline（time_point::max()表示不限时）、执行了投递的任务、报告了文件变化或
+    // 调用了关注的文件描述符的callback之一发生。目录中其他文件的变化不算，继续等待。
+    // 终端有输入或poll()被信号打断（例如终端尺寸变化的SIGWINCH）时返回true
+    bool wait(chrono::steady_clock::time_point deadline) {
+        int timeout_ms = arm_timer(deadline);
         while (true) {
-            draw();  // 绘制界面
-            char ch = getch();  // 获取用户输入
-            if (command_mode_active) {
-                command_mode(ch);  // 处理命令模式输入
-            } else if (insert_mode_active) {
-                insert_mode(ch);  // 处理插入模式输入
+            vector<pollfd> fds = {{STDIN_FILENO, POLLIN, 0}, {wake_fd, POLLIN, 0}, {timer_fd, POLLIN, 0}, {notify_fd, POLLIN, 0}};
+            for (const Reader& r : readers) fds.push_back({r.fd, POLLIN, 0});
+            int ready = poll(fds.data(), fds.size(), timeout_ms);
+            if (ready < 0) return true;
+            uint64_t count;
+            if (fds[1].revents && read(wake_fd, &count, sizeof(count)) < 0) {}
+            if (fds[2].revents && read(timer_fd, &count, sizeof(count)) < 0) {}
+            bool handled = run_posted();
+            if (fds[3].revents && read_notifications()) handled = true;
+            vector<Reader> ready_readers;
+            for (size_t i = 4; i < fds.size(); ++i) {
+                if (fds[i].revents) ready_readers.push_back(readers[i - 4]);
+            }
+            for (const Reader& r : ready_readers) {  // 前面的callback可能已经移除了后面的fd
+                auto still = find_if(readers.begin(), readers.end(), [&r](const Reader& x) { return x.callback == r.callback; });
+                if (still == readers.end()) continue;
+                (*r.callback)();
+                handled = true;
+            }
+            if (fds[0].revents) return true;
+            if (handled || fds[2].revents || ready == 0) return false;
+        }
+    }
+
+private:
+    struct Task {
+        function<void()> fn;
+        Task* next;
+    };
+    struct Watch {
+        int wd;
+        string name;  // 目录中的文件名
+        string path;
+    };
+    struct Reader {
+        int fd;
+        shared_ptr<function<void()>> callback;  // 执行期间由调用者持有一份，callback中移除自己也是安全的
+    };
+    atomic<Task*> posted{nullptr};  // 已投递、尚未执行的任务（后投递的在前）
+    int wake_fd = -1, timer_fd = -1, notify_fd = -1;
+    vector<Watch> watches;
+    vector<Reader> readers;
+
+    // 把timerfd设为deadline（绝对时间，steady_clock即CLOCK_MONOTONIC）；返回poll()的超时，
+    // 只有timerfd不可用时才用超时代替
+    int arm_timer(chrono::steady_clock::time_point deadline) {
+        bool forever = deadline == chrono::steady_clock::time_point::max();
+        if (timer_fd < 0) {
+            if (forever) return -1;
+            auto ms = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+            return (int)max<long long>(0, min<long long>(ms + 1, INT_MAX));
+        }
+        itimerspec spec = {};
+        if (!forever) {
+            long long ns = max<long long>(1, chrono::duration_cast<chrono::nanoseconds>(deadline.time_since_epoch()).count());
+            spec.it_value.tv_sec = ns / 1000000000;
+            spec.it_value.tv_nsec = ns % 1000000000;
+        }
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);  // 全零则停止计时
+        return -1;
+    }
+
+    // 读出所有inotify事件，同一个文件的多次变化只报告一次；没有被监视文件的事件时返回false
+    bool read_notifications() {
+        vector<string> changed;
+        alignas(inotify_event) char buffer[4096];
+        ssize_t length;
+        while ((length = read(notify_fd, buffer, sizeof(buffer))) > 0) {
+            for (char* p = buffer; p < buffer + length; ) {
+                const inotify_event* event = (const inotify_event*)p;
+                p += sizeof(inotify_event) + event->len;
+                if (event->len == 0) continue;
+                for (const Watch& w : watches) {
+                    if (w.wd == event->wd && w.name == event->name && find(changed.begin(), changed.end(), w.path) == changed.end()) {
+                        changed.push_back(w.path);
+                    }
+                }
+            }
+        }
+        for (const string& path : changed) {
+            if (on_file_change) on_file_change(path);
+        }
+        return !changed.empty();
+    }
+};
+
+// 在[begin, end)中查找字符串：先用memchr（glibc中为向量化实现）跳到首字符的候选位置，再比较其余部分
+static const char* find_literal(const char* begin, const char* end, const string& pattern) {
+    size_t n = pattern.size();
+    if (n == 0) return begin;
+    while (end - begin >= (ptrdiff_t)n) {
+        const char* p = (const char*)memchr(begin, pattern[0], end - begin - n + 1);
+        if (!p) return nullptr;
+        if (memcmp(p + 1, pattern.data() + 1, n - 1) == 0) return p;
+        begin = p + 1;
+    }
+    return nullptr;
+}
+
+// 关键字索引：所有缓冲区中出现的单词及其出现次数，按字典序保存，供插入模式的Ctrl+N/Ctrl+P补全按前缀查找。
+// 文件加载时在后台线程中统计整个文件；之后每个缓冲区记住上一次同步时的内容快照，
+// 同步时只对快照与当前内容之间不同的行减去旧单词、加上新单词。
+// 后台统计与增量同步的先后顺序不影响结果（次数可以暂时为负）
+class KeywordIndex {
+public:
+    ~KeywordIndex() {
+        stopping = true;
+        builder.reset();  // 等待后台统计结束
+    }
+
+    static bool is_word_char(char c) { return isalnum((unsigned char)c) || c == '_'; }
+
+    // 同update，在后台线程中进行。文件刚读入时old为索引中原来的内容（没有时为空），
+    // 重新读入的文件里已经不存在的单词会从索引中去掉
+    void update_async(LineBuffer old, LineBuffer now) {
+        if (!builder) builder = make_unique<ThreadPool>(1);
+        builder->submit([this, old, now]() {
+            map<string, int> delta;
+            if (!count_changes(old, now, delta)) return;
+            lock_guard<mutex> guard(lock);
+            for (const auto& entry : delta) adjust(entry.first, entry.second);
+        });
+    }
+
+    // 把缓冲区从old到now的修改同步到索引，只处理两者之间不同的行
+    void update(const LineBuffer& old, const LineBuffer& now) {
+        map<string, int> delta;
+        count_changes(old, now, delta);
+        lock_guard<mutex> guard(lock);
+        for (const auto& entry : delta) adjust(entry.first, entry.second);
+    }
+
+    // 以prefix开头的单词中，按字典序位于current之后（forward）或之前的第一个，不包括prefix本身。
+    // current为空时从第一个（或最后一个）开始
+    bool next(const string& prefix, const string& current, bool forward, string& out) {
+        lock_guard<mutex> guard(lock);
+        auto has_prefix = [&](const string& word) { return word.compare(0, prefix.size(), prefix) == 0; };
+        if (forward) {
+            auto it = current.empty() ? words.lower_bound(prefix) : words.upper_bound(current);
+            for (; it != words.end() && has_prefix(it->first); ++it) {
+                if (it->second > 0 && it->first != prefix) {
+                    out = it->first;
+                    return true;
+                }
+            }
+        } else {
+            // 单词只含字母、数字和下划线，prefix + '\x7f' 大于所有以prefix开头的单词
+            auto it = words.lower_bound(current.empty() ? prefix + '\x7f' : current);
+            while (it != words.begin() && has_prefix((--it)->first)) {
+                if (it->second > 0 && it->first != prefix) {
+                    out = it->first;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+private:
+    mutex lock;
+    map<string, int> words;            // 单词 -> 出现次数
+    unique_ptr<ThreadPool> builder;    // 后台统计线程，第一次使用时创建
+    atomic<bool> stopping{false};
+
+    // 统计old与now之间不同的行中各单词出现次数的变化，编辑器退出时中途放弃并返回false
+    bool count_changes(const LineBuffer& old, const LineBuffer& now, map<string, int>& delta) {
+        size_t head, tail, n = 0;
+        old.common_affixes(now, head, tail);
+        for (size_t i = head; i + tail < old.size(); ++i) {
+            if ((++n & 4095) == 0 && stopping) return false;
+            count_words(old[i], -1, delta);
+        }
+        for (size_t i = head; i + tail < now.size(); ++i) {
+            if ((++n & 4095) == 0 && stopping) return false;
+            count_words(now[i], 1, delta);
+        }
+        return true;
+    }
+
+    static void count_words(const string& line, int sign, map<string, int>& counts) {
+        for (size_t i = 0; i < line.size();) {
+            if (!is_word_char(line[i])) {
+                ++i;
+                continue;
+            }
+            size_t end = i;
+            while (end < line.size() && is_word_char(line[end])) ++end;
+            counts[line.substr(i, end - i)] += sign;
+            i = end;
+        }
+    }
+
+    void adjust(const string& word, int delta) {
+        if (delta == 0) return;
+        auto it = words.emplace(word, 0).first;
+        if ((it->second += delta) == 0) words.erase(it);
+    }
+};
+
+// 标签文件（ctags格式，按名称排序）：用mmap映射整个文件，查找时按名称二分，打开时不做任何解析，
+// 十万个符号的标签文件一次查找也只需比较十几行
+class TagFile {
+public:
+    struct Tag {
+        string name, file, address;  // address为行号或 /^...$/ 形式的查找模式
+    };
+
+    ~TagFile() { close(); }
+
+    // 映射标签文件；已经映射且文件未变化时直接返回
+    bool open(const string& tag_path) {
+        struct stat st;
+        if (stat(tag_path.c_str(), &st) != 0) {
+            close();
+            return false;
+        }
+        if (data && tag_path == path && st.st_mtime == mtime && (size_t)st.st_size == size && st.st_ino == inode) return true;
+        close();
+        int fd = ::open(tag_path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        if (st.st_size > 0) {
+            void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) data = (const char*)mapped;
+        }
+        ::close(fd);
+        if (!data && st.st_size > 0) return false;
+        path = tag_path;
+        size = st.st_size;
+        mtime = st.st_mtime;
+        inode = st.st_ino;
+        return true;
+    }
+
+    void close() {
+        if (data) munmap((void*)data, size);
+        data = nullptr;
+        size = 0;
+        path.clear();
+    }
+
+    // 查找名称为name的所有标签
+    vector<Tag> find(const string& name) const {
+        vector<Tag> tags;
+        if (name.compare(0, 6, "!_TAG_") == 0) return tags;  // 文件头的元信息行
+        // lo、hi始终位于行首：二分时从中点退回所在行的行首再比较这一行的名称
+        size_t lo = 0, hi = size;
+        while (lo < hi) {
+            size_t start = lo + (hi - lo) / 2;
+            while (start > lo && data[start - 1] != '\n') --start;
+            if (compare_name(start, name) < 0) {
+                lo = next_line(start);
             } else {
-                normal_mode(ch);  // 处理普通模式输入
+                hi = start;
             }
         }
+        for (size_t pos = lo; pos < size && compare_name(pos, name) == 0; pos = next_line(pos)) {
+            const char* line = data + pos;
+            const char* end = data + next_line(pos);
+            if (end > line && end[-1] == '\n') --end;
+            const char* tab1 = (const char*)memchr(line, '\t', end - line);
+            const char* tab2 = tab1 ? (const char*)memchr(tab1 + 1, '\t', end - tab1 - 1) : nullptr;
+            if (!tab2) continue;
+            string address(tab2 + 1, end);
+            size_t extra = address.find(";\"");  // 去掉 ;" 之后的扩展字段
+            if (extra != string::npos) address.erase(extra);
+            tags.push_back({name, string(tab1 + 1, tab2), address});
+        }
+        return tags;
     }
-    
-    // 初始化ncurses环境
-    void init() {
-        initscr();  // 初始化屏幕
-        keypad(stdscr, TRUE);  // 启用键盘功能键
-        noecho();  // 关闭输入回显
-        cbreak();  // 禁用行缓冲
-        raw();  // 禁用Ctrl+C等信号
-        curs_set(TRUE);  // 显示光标
-        getmaxyx(stdscr, screen_height, screen_width);  // 获取屏幕尺寸
-        refresh();  // 刷新屏幕
+
+    const string& file_path() const { return path; }
+
+private:
+    string path;
+    const char* data = nullptr;
+    size_t size = 0;
+    time_t mtime = 0;
+    ino_t inode = 0;
+
+    size_t next_line(size_t pos) const {
+        const char* newline = (const char*)memchr(data + pos, '\n', size - pos);
+        return newline ? newline - data + 1 : size;
+    }
+
+    // 比较pos处这一行的名称（第一个制表符之前）与name，按字节序
+    int compare_name(size_t pos, const string& name) const {
+        size_t end = pos;
+        while (end < size && data[end] != '\t' && data[end] != '\n') ++end;
+        size_t length = end - pos;
+        int result = memcmp(data + pos, name.data(), min(length, name.size()));
+        if (result != 0) return result;
+        return length < name.size() ? -1 : (length > name.size() ? 1 : 0);
+    }
+};
+
+// 模糊文件查找：项目目录树中的文件列表及其字符集合，按输入的查询打分排序
+class FileFinder {
+public:
+    // 用getdents64并行遍历目录树，跳过以.开头的文件和目录（.git等）与符号链接
+    void scan(const string& root) {
+        files.clear();
+        masks.clear();
+        last_query.clear();
+        candidates.clear();
+        mutex lock;
+        walk_directory(pool(), root, lock, files);
+        pool().wait();
+        sort(files.begin(), files.end());
+        masks.resize(files.size());
+        for (size_t i = 0; i < files.size(); ++i) masks[i] = char_mask(files[i]);
+        scanned = true;
+    }
+
+    bool empty() const { return !scanned; }
+    size_t size() const { return files.size(); }
+    const string& operator[](size_t i) const { return files[i]; }
+
+    // 返回得分最高的至多limit个文件的下标，total为匹配的文件总数。查询在上一次查询后追加字符时
+    // 只在上一次的匹配结果中查找；每块文件由线程池并行打分
+    vector<uint32_t> match(const string& query, size_t limit, size_t& total) {
+        bool narrowing = !last_query.empty() && query.compare(0, last_query.size(), last_query) == 0;
+        vector<uint32_t> scope;
+        if (!narrowing) {
+            scope.resize(files.size());
+            for (size_t i = 0; i < files.size(); ++i) scope[i] = i;
+        } else {
+            scope = std::move(candidates);
+        }
+        bool ignore_case = none_of(query.begin(), query.end(), [](char c) { return isupper((unsigned char)c); });
+        uint64_t query_mask = char_mask(query);
+
+        const size_t block = 16384;
+        vector<vector<pair<int, uint32_t>>> scored((scope.size() + block - 1) / block);
+        for (size_t b = 0; b < scored.size(); ++b) {
+            pool().submit([&, b]() {
+                size_t end = min(scope.size(), (b + 1) * block);
+                for (size_t k = b * block; k < end; ++k) {
+                    uint32_t i = scope[k];
+                    if ((masks[i] & query_mask) != query_mask) continue;  // 缺少查询中的字符
+                    int score = fuzzy_score(files[i], query, ignore_case);
+                    if (score >= 0) scored[b].push_back({score, i});
+                }
+            });
+        }
+        pool().wait();
+
+        vector<pair<int, uint32_t>> all;
+        for (auto& part : scored) all.insert(all.end(), part.begin(), part.end());
+        candidates.resize(all.size());
+        for (size_t k = 0; k < all.size(); ++k) candidates[k] = all[k].second;
+        last_query = query;
+        total = all.size();
+
+        auto better = [this](const pair<int, uint32_t>& a, const pair<int, uint32_t>& b) {
+            if (a.first != b.first) return a.first > b.first;
+            if (files[a.second].size() != files[b.second].size()) return files[a.second].size() < files[b.second].size();
+            return a.second < b.second;
+        };
+        size_t count = min(limit, all.size());
+        partial_sort(all.begin(), all.begin() + count, all.end(), better);
+        vector<uint32_t> best(count);
+        for (size_t k = 0; k < count; ++k) best[k] = all[k].second;
+        return best;
+    }
+
+    // 模糊匹配得分，不匹配时返回-1：query的字符须按顺序出现在path中。先正向找到最早完成匹配的位置，
+    // 再从那里反向找到最短的匹配窗口；窗口内连续匹配、在单词开头匹配、在文件名部分匹配都加分，间隔扣分
+    static int fuzzy_score(const string& path, const string& query, bool ignore_case) {
+        static const struct LowerTable {
+            unsigned char map[256];
+            LowerTable() { for (int c = 0; c < 256; ++c) map[c] = (c >= 'A' && c <= 'Z') ? c + 32 : c; }
+        } lower;  // 查表代替tolower，避免每个字符一次函数调用
+        auto same = [ignore_case](char a, char b) { return (ignore_case ? (char)lower.map[(unsigned char)a] : a) == b; };
+        if (query.empty()) return 0;
+        size_t q = 0, end = 0;
+        for (size_t i = 0; i < path.size(); ++i) {
+            if (same(path[i], query[q]) && ++q == query.size()) {
+                end = i;
+                break;
+            }
+        }
+        if (q < query.size()) return -1;
+        size_t start = end;
+        for (size_t i = end + 1, r = query.size(); i-- > 0;) {
+            if (same(path[i], query[r - 1]) && --r == 0) {
+                start = i;
+                break;
+            }
+        }
+        size_t name_start = path.rfind('/') == string::npos ? 0 : path.rfind('/') + 1;
+        int score = 0;
+        size_t last = string::npos;
+        q = 0;
+        for (size_t i = start; i <= end; ++i) {
+            if (q < query.size() && same(path[i], query[q])) {
+                score += 16;
+                if (last != string::npos && i == last + 1) score += 12;  // 连续匹配
+                if (i == 0 || strchr("/_-. ", path[i - 1]) || (islower((unsigned char)path[i - 1]) && isupper((unsigned char)path[i]))) score += 10;  // 单词开头
+                if (i >= name_start) score += 6;  // 文件名部分
+                last = i;
+                ++q;
+            } else {
+                score -= 1;  // 间隔
+            }
+        }
+        return score;
+    }
+
+private:
+    vector<string> files;               // 相对路径
+    vector<uint64_t> masks;             // 每个路径的字符集合
+    bool scanned = false;
+    string last_query;                  // 上一次的查询
+    vector<uint32_t> candidates;        // 上一次查询匹配的文件
+    unique_ptr<ThreadPool> workers;
+
+    ThreadPool& pool() {
+        if (!workers) workers = make_unique<ThreadPool>();
+        return *workers;
+    }
+
+    // 路径中出现的字符集合（不区分大小写，按低6位映射到64位），查询的集合必须是路径集合的子集。
+    // 映射有重叠只会放过少量不匹配的路径，不会漏掉匹配的路径
+    static uint64_t char_mask(const string& text) {
+        uint64_t mask = 0;
+        for (char c : text) mask |= 1ull << (tolower((unsigned char)c) & 63);
+        return mask;
+    }
+
+    struct linux_dirent64 {
+        ino64_t d_ino;
+        off64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+    // 读取一个目录：文件加入结果，子目录作为新任务交给线程池
+    static void walk_directory(ThreadPool& pool, const string& dir, mutex& lock, vector<string>& out) {
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) return;
+        vector<string> found;
+        vector<char> buffer(1 << 16);
+        long n;
+        while ((n = syscall(SYS_getdents64, fd, buffer.data(), buffer.size())) > 0) {
+            for (long pos = 0; pos < n;) {
+                const linux_dirent64* entry = (const linux_dirent64*)(buffer.data() + pos);
+                pos += entry->d_reclen;
+                if (entry->d_name[0] == '.') continue;
+                string path = (dir == ".") ? string(entry->d_name) : dir + "/" + entry->d_name;
+                unsigned char type = entry->d_type;
+                if (type == DT_UNKNOWN) {
+                    struct stat st;
+                    if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+                    }
+                }
+                if (type == DT_DIR) {
+                    pool.submit([&pool, path, &lock, &out]() { walk_directory(pool, path, lock, out); });
+                } else if (type == DT_REG) {
+                    found.push_back(std::move(path));
+                }
+            }
+        }
+        ::close(fd);
+        lock_guard<mutex> guard(lock);
+        out.insert(out.end(), make_move_iterator(found.begin()), make_move_iterator(found.end()));
+    }
+};
+
+// 两个缓冲区之间按行的差异。先去掉相同的开头和结尾，中间的行散列成64位整数后剔除只在一侧出现的行
+// （它们一定是改动），剩下的行用Myers算法（线性空间的分治版本）求最长公共子序列。
+// 修改其中一侧后只重算修改范围以及与之相交或相邻的区块
+class LineDiff {
+public:
+    // 改动区块：两侧各自的起始行和行数，行数为0表示这一侧没有对应的行
+    struct Hunk {
+        size_t start[2], count[2];
+        size_t end(int side) const { return start[side] + count[side]; }
+    };
+
+    void compute(const LineBuffer& a, const LineBuffer& b) {
+        text[0] = a;
+        text[1] = b;
+        size_t head, tail;
+        a.common_affixes(b, head, tail);
+        all = diff_range(head, a.size() - tail, head, b.size() - tail);
+    }
+
+    // 第side侧的内容改为now：与上次比较时的内容对比求出修改范围，其余区块只调整行号
+    void update(int side, const LineBuffer& now) {
+        size_t head, tail;
+        text[side].common_affixes(now, head, tail);
+        size_t old_end = text[side].size() - tail, new_end = now.size() - tail;
+        text[side] = now;
+        if (head == old_end && head == new_end) return;
+        int other = 1 - side;
+        size_t h0 = lower_bound(all.begin(), all.end(), head, [side](const Hunk& hunk, size_t line) { return hunk.end(side) < line; }) - all.begin();
+        size_t h1 = h0;
+        while (h1 < all.size() && all[h1].start[side] <= old_end) ++h1;
+        size_t from = head, to = old_end;
+        if (h1 > h0) {
+            from = min(from, all[h0].start[side]);
+            to = max(to, all[h1 - 1].end(side));
+        }
+        // 区块之间相同的部分两侧的行号之差不变
+        auto shift = [&](size_t h) { return h == 0 ? 0 : (ptrdiff_t)all[h - 1].end(other) - (ptrdiff_t)all[h - 1].end(side); };
+        size_t other_from = from + shift(h0), other_to = to + shift(h1), now_to = to - old_end + new_end;
+        vector<Hunk> redone = side == 0 ? diff_range(from, now_to, other_from, other_to) : diff_range(other_from, other_to, from, now_to);
+        for (size_t h = h1; h < all.size(); ++h) all[h].start[side] = all[h].start[side] - old_end + new_end;
+        all.erase(all.begin() + h0, all.begin() + h1);
+        all.insert(all.begin() + h0, redone.begin(), redone.end());
+    }
+
+    const LineBuffer& lines(int side) const { return text[side]; }
+    const vector<Hunk>& hunks() const { return all; }
+
+private:
+    LineBuffer text[2];  // 上次比较时两侧的内容
+    vector<Hunk> all;    // 按行号排列的改动区块，相邻区块之间至少隔一行相同的行
+
+    // 只用来判断某个散列值是否出现过的开放寻址表
+    struct HashSet {
+        vector<uint64_t> slots;
+        size_t mask;
+        explicit HashSet(const vector<uint64_t>& values) {
+            size_t size = 16;
+            while (size < values.size() * 2) size <<= 1;
+            slots.assign(size, 0);
+            mask = size - 1;
+            for (uint64_t value : values) {
+                size_t i = find(value);
+                slots[i] = value | 1;
+            }
+        }
+        bool contains(uint64_t value) const { return slots[find(value)] != 0; }
+        size_t find(uint64_t value) const {
+            size_t i = (value >> 1) & mask;
+            while (slots[i] != 0 && slots[i] != (value | 1)) i = (i + 1) & mask;
+            return i;
+        }
+    };
+
+    // Myers差分：把两侧相同的元素按顺序以下标对的形式加入matches
+    struct Myers {
+        const vector<uint64_t>& a;
+        const vector<uint64_t>& b;
+        vector<pair<uint32_t, uint32_t>>& matches;
+
+        void compare(size_t a0, size_t a1, size_t b0, size_t b1) {
+            while (a0 < a1 && b0 < b1 && a[a0] == b[b0]) matches.emplace_back(a0++, b0++);
+            size_t suffix = 0;
+            while (a0 < a1 - suffix && b0 < b1 - suffix && a[a1 - 1 - suffix] == b[b1 - 1 - suffix]) ++suffix;
+            if (a0 < a1 - suffix && b0 < b1 - suffix) bisect(a0, a1 - suffix, b0, b1 - suffix);
+            for (size_t k = suffix; k > 0; --k) matches.emplace_back(a1 - k, b1 - k);
+        }
+
+        // 从两端同时搜索，在最短编辑路径的中点把问题一分为二。编辑距离超过上限（差异太大，完整求解太慢）时
+        // 改从正向走得最远的位置分开，结果仍然正确，只是不一定最短
+        void bisect(size_t a0, size_t a1, size_t b0, size_t b1) {
+            long n = a1 - a0, m = b1 - b0, delta = n - m;
+            long max_d = min((n + m + 1) / 2, 512L), offset = max_d + 1, length = 2 * max_d + 3;
+            vector<long> forward(length, -1), backward(length, -1);
+            forward[offset + 1] = backward[offset + 1] = 0;
+            bool odd = delta & 1;
+            long k1_start = 0, k1_end = 0, k2_start = 0, k2_end = 0, best_x = 0, best_y = 0;
+            for (long d = 0; d < max_d; ++d) {
+                for (long k = -d + k1_start; k <= d - k1_end; k += 2) {
+                    long i = offset + k;
+                    long x = (k == -d || (k != d && forward[i - 1] < forward[i + 1])) ? forward[i + 1] : forward[i - 1] + 1;
+                    long y = x - k;
+                    while (x < n && y < m && a[a0 + x] == b[b0 + y]) ++x, ++y;
+                    forward[i] = x;
+                    if (x > n) {
+                        k1_end += 2;
+                    } else if (y > m) {
+                        k1_start += 2;
+                    } else {
+                        if (x + y > best_x + best_y) best_x = x, best_y = y;
+                        long j = offset + delta - k;
+                        if (odd && j >= 0 && j < length && backward[j] != -1 && x >= n - backward[j]) {
+                            return split(a0, a1, b0, b1, x, y);
+                        }
+                    }
+                }
+                for (long k = -d + k2_start; k <= d - k2_end; k += 2) {
+                    long i = offset + k;
+                    long x = (k == -d || (k != d && backward[i - 1] < backward[i + 1])) ? backward[i + 1] : backward[i - 1] + 1;
+                    long y = x - k;
+                    while (x < n && y < m && a[a1 - 1 - x] == b[b1 - 1 - y]) ++x, ++y;
+                    backward[i] = x;
+                    if (x > n) {
+                        k2_end += 2;
+                    } else if (y > m) {
+                        k2_start += 2;
+                    } else {
+                        long j = offset + delta - k;
+                        if (!odd && j >= 0 && j < length && forward[j] != -1 && forward[j] >= n - x) {
+                            return split(a0, a1, b0, b1, forward[j], offset + forward[j] - j);
+                        }
+                    }
+                }
+            }
+            if (best_x + best_y > 0 && (best_x < n || best_y < m)) split(a0, a1, b0, b1, best_x, best_y);
+        }
+
+        void split(size_t a0, size_t a1, size_t b0, size_t b1, long x, long y) {
+            compare(a0, a0 + x, b0, b0 + y);
+            compare(a0 + x, a1, b0 + y, b1);
+        }
+    };
+
+    // 比较第0侧的[a0, a1)行与第1侧的[b0, b1)行，返回按原行号表示的改动区块。
+    // 行按64位散列比较，不同的行散列相同的概率可以忽略
+    vector<Hunk> diff_range(size_t a0, size_t a1, size_t b0, size_t b1) const {
+        size_t from[2] = {a0, b0};
+        vector<uint64_t> hashes[2] = {vector<uint64_t>(a1 - a0), vector<uint64_t>(b1 - b0)};
+        auto hash_lines = [&](int side) {
+            auto it = text[side].at(from[side]);
+            for (uint64_t& value : hashes[side]) {
+                value = std::hash<string>()(*it);
+                ++it;
+            }
+        };
+        if (hashes[0].size() + hashes[1].size() > 65536) {
+            thread helper(hash_lines, 1);
+            hash_lines(0);
+            helper.join();
+        } else {
+            hash_lines(0);
+            hash_lines(1);
+        }
+
+        // 剔除只在一侧出现的行，kept记录剩下的行在区间内的下标
+        vector<uint32_t> kept[2];
+        vector<uint64_t> values[2];
+        for (int side = 0; side < 2; ++side) {
+            HashSet others(hashes[1 - side]);
+            for (size_t i = 0; i < hashes[side].size(); ++i) {
+                if (!others.contains(hashes[side][i])) continue;
+                kept[side].push_back(i);
+                values[side].push_back(hashes[side][i]);
+            }
+        }
+        vector<pair<uint32_t, uint32_t>> matches;
+        Myers{values[0], values[1], matches}.compare(0, values[0].size(), 0, values[1].size());
+
+        // 相邻两对相同的行之间就是一个改动区块
+        vector<Hunk> result;
+        size_t pos[2] = {0, 0};
+        auto emit = [&](size_t end0, size_t end1) {
+            if (end0 > pos[0] || end1 > pos[1]) result.push_back({{a0 + pos[0], b0 + pos[1]}, {end0 - pos[0], end1 - pos[1]}});
+            pos[0] = end0 + 1;
+            pos[1] = end1 + 1;
+        };
+        for (const auto& match : matches) emit(kept[0][match.first], kept[1][match.second]);
+        emit(hashes[0].size(), hashes[1].size());
+        return result;
+    }
+};
+
+// 文件在磁盘上的修改时间（纳秒）和大小，文件不存在时为{-1, -1}
+static pair<long long, long long> file_stamp(const string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return {-1, -1};
+    return {st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec, (long long)st.st_size};
+}
+
+// 二进制数据的写出与读取：定长整数按本机字节序原样写出，读取时用memcpy，不要求对齐；
+// 行长度等小整数用变长编码（每字节7位，最高位表示后面还有），大多数行的长度只占一个字节。越界时读取失败
+struct ByteWriter {
+    string out;
+
+    template <class T> void put(T value) { out.append((const char*)&value, sizeof(T)); }
+
+    void put_varint(uint64_t value) {
+        while (value >= 0x80) {
+            out += (char)(value | 0x80);
+            value >>= 7;
+        }
+        out += (char)value;
+    }
+
+    // [first, last)范围内的行，每行为长度和内容
+    void put_lines(const LineBuffer& text, size_t first, size_t last) {
+        size_t pos = first;
+        for (auto it = text.at(first); pos < last; ++it, ++pos) {
+            put_varint((*it).size());
+            out += *it;
+        }
+    }
+};
+
+struct ByteReader {
+    const char* p;
+    const char* end;
+
+    ByteReader(const char* begin, size_t length) : p(begin), end(begin + length) {}
+
+    template <class T> bool get(T& value) {
+        if ((size_t)(end - p) < sizeof(T)) return false;
+        memcpy(&value, p, sizeof(T));
+        p += sizeof(T);
+        return true;
+    }
+
+    bool get_varint(uint64_t& value) {
+        value = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7) {
+            unsigned char byte = *p++;
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return false;
+    }
+
+    // put_lines写出的count行
+    bool get_lines(size_t count, vector<string>& lines) {
+        if ((size_t)(end - p) < count) return false;  // 每行至少一个字节
+        lines.reserve(lines.size() + count);
+        for (size_t i = 0; i < count; ++i) {
+            uint64_t length;
+            if (!get_varint(length) || (size_t)(end - p) < length) return false;
+            lines.emplace_back(p, length);
+            p += length;
+        }
+        return true;
+    }
+};
+
+// 状态state相对from的差量：相同的开头行数、相同的结尾行数和中间不同的行
+static void encode_delta(ByteWriter& w, const LineBuffer& state, const LineBuffer& from) {
+    size_t head, tail;
+    state.common_affixes(from, head, tail);
+    w.put<uint64_t>(head);
+    w.put<uint64_t>(tail);
+    w.put<uint64_t>(state.size() - head - tail);
+    w.put_lines(state, head, state.size() - tail);
+}
+
+// 把text（encode_delta的from）变为差量记录的状态
+static bool decode_delta(ByteReader& r, LineBuffer& text) {
+    uint64_t head, tail, middle;
+    vector<string> lines;
+    if (!r.get(head) || !r.get(tail) || !r.get(middle) || head + tail > text.size() || !r.get_lines(middle, lines)) return false;
+    text.replace(head, text.size() - tail, std::move(lines));
+    return true;
+}
+
+// 撤销历史的差量编码：从当前内容开始，依次记录撤销栈中每个状态（从栈顶往下）与它上面一个状态的差量。
+// 相邻的撤销状态通常只差几行，编码很紧凑
+static void encode_undo(ByteWriter& w, stack<LineBuffer> undo, LineBuffer current) {
+    w.put<uint32_t>(undo.size());
+    while (!undo.empty()) {
+        encode_delta(w, undo.top(), current);
+        current = undo.top();
+        undo.pop();
+    }
+}
+
+// 从current出发逐个还原encode_undo记录的状态，从新到旧追加到states，current变为最早的状态；
+// 还原出的状态与当前内容共享没有变化的块
+static bool decode_undo_states(ByteReader& r, LineBuffer& current, vector<LineBuffer>& states) {
+    uint32_t count;
+    if (!r.get(count)) return false;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!decode_delta(r, current)) return false;
+        states.push_back(current);
+    }
+    return true;
+}
+
+static bool decode_undo(ByteReader& r, LineBuffer current, stack<LineBuffer>& undo) {
+    vector<LineBuffer> states;
+    if (!decode_undo_states(r, current, states)) return false;
+    for (auto it = states.rbegin(); it != states.rend(); ++it) undo.push(*it);
+    return true;
+}
+
+// 撤销树（与vim相同）：每次修改后的文本是一个节点，撤销之后再修改产生新的分支，原来的分支仍然保留。
+// 节点按修改的先后编号（0为最初的文本），u / Ctrl+r沿父子关系移动（Ctrl+r进入最近去过的子节点），
+// g- / g+ 和 :earlier / :later 按编号或修改时间在所有分支之间移动。
+// 节点的文本是写时复制快照，与相邻节点共享没有修改的块，只有修改过的块占用额外的内存。估计的内存超过预算时，
+// 从最早的节点开始把快照换成相对一个相邻节点的差量（压缩），差量仍然超过预算时写入临时文件（换出）。
+// 压缩的节点相对它的一个子节点，没有子节点时相对父节点，且不会与差量所相对的节点互相依赖，
+// 所以取一个压缩节点的文本时沿差量的依赖一定能走到有快照的节点，再逐个应用差量。
+// 插入模式的修改经edit()记录为少数几个合并过的操作（在某处删除一段文字、插入一段文字），整个插入作为一个节点，
+// 只保存这些操作而不保存快照；操作同时记录了删除和插入的文字，从子节点的文本倒着应用就得到父节点的文本
+class UndoTree {
+public:
+    static inline atomic<size_t> budget{64 << 20};  // 每个缓冲区撤销历史的内存预算（字节），0表示不限制
+
+    // 撤销列表（:undolist）的一项：一个分支的末端
+    struct Leaf {
+        long seq;        // 修改编号
+        size_t changes;  // 从最初的文本到这里的修改次数
+        time_t time;
+    };
+
+    bool empty() const { return nodes.empty(); }
+    long current_seq() const { return nodes.empty() ? 0 : nodes[current].seq; }
+    long last_seq() const { return (long)by_seq.size() - 1; }
+    bool at_root() const { return nodes.empty() || nodes[current].parent < 0; }
+    size_t memory() const { return total_cost; }
+
+    // 清空历史，text为最初的文本
+    void reset(const LineBuffer& text) {
+        *this = UndoTree();
+        Node root;
+        root.text = text;
+        root.time = ::time(nullptr);
+        nodes.push_back(root);
+        by_seq.push_back(0);
+    }
+
+    // 修改缓冲区之前调用：记下此前的修改，接下来的修改从现在开始计时，并开始记录edit()的操作
+    void checkpoint(const LineBuffer& text) {
+        commit(text);
+        change_time = ::time(nullptr);
+        edits.clear();
+        recording = true;
+        recorded_version = text.version();
+    }
+
+    // 在第line行第column列删除erased、插入inserted（都可以跨行），同时记录这次修改。
+    // 紧接在上一个操作插入的文字之后继续输入时并入上一个操作，退格删除刚输入的文字时从上一个操作中去掉，
+    // 继续退格时把删除的文字并到上一个操作的前面，所以一次插入通常只有一两个操作。
+    // 自checkpoint以来文本有过没经这里的修改时不再记录，这一步仍然保存快照
+    void edit(LineBuffer& text, size_t line, size_t column, const string& erased, const string& inserted) {
+        bool tracked = recording && text.version() == recorded_version;
+        recording = false;
+        if (!apply_edit(text, line, column, erased, inserted) || !tracked) return;
+        if (!erased.empty()) record_erase(line, column, erased);
+        if (!inserted.empty()) record_insert(line, column, inserted);
+        recording = true;
+        recorded_version = text.version();
+    }
+
+    // text与当前节点的文本不同时，作为当前节点的新子节点记下（成为Ctrl+r的去向）
+    void commit(const LineBuffer& text) {
+        if (nodes.empty()) {
+            reset(text);
+            return;
+        }
+        Node& at = nodes[current];
+        if (text.version() == at.text.version()) return;
+        size_t head, tail;
+        text.common_affixes(at.text, head, tail);
+        if (text.size() == at.text.size() && head + tail == text.size()) {
+            at.text = text;  // 内容没有变化
+            return;
+        }
+        Node node;
+        node.seq = by_seq.size();
+        node.parent = current;
+        node.time = change_time ? change_time : ::time(nullptr);
+        node.text = text;
+        if (recording && recorded_version == text.version() && !edits.empty()) {
+            ByteWriter w;  // 整步修改都经过edit()：只保存操作
+            w.put_varint(edits.size());
+            for (const Edit& e : edits) {
+                w.put_varint(e.line);
+                w.put_varint(e.column);
+                w.put_varint(e.erased.size());
+                w.out += e.erased;
+                w.put_varint(e.inserted.size());
+                w.out += e.inserted;
+            }
+            node.packed = node.reversible = true;
+            node.base = current;
+            node.delta = std::move(w.out);
+            node.cost = node.delta.size();
+        } else {
+            node.cost = text.unshared_bytes(at.text);
+        }
+        recording = false;
+        if (at.packed) at.text = LineBuffer();
+        int id = nodes.size();
+        at.children.push_back(id);
+        at.last_child = id;
+        nodes.push_back(std::move(node));
+        by_seq.push_back(id);
+        current = id;
+        total_cost += nodes[id].cost;
+        change_time = 0;
+        enforce_budget();
+    }
+
+    // 把当前节点（最新的一步，没有子节点）的文本换成text：这一步记下之后又有了后续（:r !命令的输出分批到达）。
+    // 不是这样的节点时返回false。相对它压缩的父节点先还原成快照
+    bool extend(const LineBuffer& text) {
+        if (nodes.empty() || current != by_seq.back() || nodes[current].parent < 0 || !nodes[current].children.empty()) return false;
+        Node& at = nodes[current];
+        Node& parent = nodes[at.parent];
+        if (parent.packed && parent.base == current) {
+            parent.text = text_of(at.parent);
+            parent.packed = false;
+            string().swap(parent.delta);
+            parent.spill_offset = -1;
+            total_cost -= parent.cost;
+            parent.cost = parent.text.unshared_bytes(at.text);
+            total_cost += parent.cost;
+        }
+        LineBuffer before = text_of(at.parent);
+        at.packed = at.reversible = false;
+        string().swap(at.delta);
+        at.spill_offset = -1;
+        at.text = text;
+        total_cost -= at.cost;
+        at.cost = text.unshared_bytes(before);
+        total_cost += at.cost;
+        enforce_budget();
+        return true;
+    }
+
+    // 撤销：回到父节点的文本
+    bool undo(LineBuffer& text) {
+        commit(text);
+        int parent = nodes[current].parent;
+        if (parent < 0) return false;
+        nodes[parent].last_child = current;
+        move_to(parent, text);
+        return true;
+    }
+
+    // 重做：进入最近去过的子节点
+    bool redo(LineBuffer& text) {
+        commit(text);
+        int child = nodes[current].last_child;
+        if (child < 0) return false;
+        move_to(child, text);
+        return true;
+    }
+
+    // 转到编号为seq的修改之后的文本（可以在另一个分支上）
+    bool jump(long seq, LineBuffer& text) {
+        commit(text);
+        if (seq < 0 || seq > last_seq() || seq == current_seq()) return false;
+        int id = by_seq[seq];
+        for (int k = id; nodes[k].parent >= 0; k = nodes[k].parent) nodes[nodes[k].parent].last_child = k;
+        move_to(id, text);
+        return true;
+    }
+
+    // 在when或之前做出的最后一次修改的编号（都晚于when时为0）
+    long seq_at(time_t when) const {
+        auto it = upper_bound(by_seq.begin(), by_seq.end(), when, [&](time_t t, int id) { return t < nodes[id].time; });
+        return it == by_seq.begin() ? 0 : it - by_seq.begin() - 1;
+    }
+
+    time_t time_of(long seq) const { return nodes[by_seq[seq]].time; }
+
+    // 各分支的末端，按编号排列
+    vector<Leaf> leaves() const {
+        vector<Leaf> result;
+        for (int id : by_seq) {
+            if (!nodes[id].children.empty() || id == by_seq[0]) continue;
+            size_t changes = 0;
+            for (int k = id; nodes[k].parent >= 0; k = nodes[k].parent) ++changes;
+            result.push_back({nodes[id].seq, changes, nodes[id].time});
+        }
+        return result;
+    }
+
+    // 在最初的文本之前接上更早的历史（撤销文件或会话中的撤销栈，栈顶为最近的状态），它们的修改时间未知
+    void prepend(stack<LineBuffer> older) {
+        if (nodes.empty() || older.empty()) return;
+        int child = by_seq[0];
+        vector<int> added;  // 从新到旧
+        for (; !older.empty(); older.pop()) {
+            Node node;
+            node.text = older.top();
+            node.children.push_back(child);
+            node.last_child = child;
+            if (!nodes[child].packed) node.cost = node.text.unshared_bytes(nodes[child].text);
+            total_cost += node.cost;
+            int id = nodes.size();
+            nodes[child].parent = id;
+            nodes.push_back(std::move(node));
+            added.push_back(id);
+            child = id;
+        }
+        by_seq.insert(by_seq.begin(), added.rbegin(), added.rend());
+        for (size_t seq = 0; seq < by_seq.size(); ++seq) nodes[by_seq[seq]].seq = seq;
+        enforce_budget();
+    }
+
+    // 从最初的文本到当前节点的父节点的各个状态（栈顶为父节点），即撤销可以回到的状态，用于保存撤销历史。
+    // 其他分支不在其中
+    stack<LineBuffer> history() const {
+        vector<LineBuffer> path;  // 从新到旧
+        int child = current;
+        LineBuffer text = nodes.empty() ? LineBuffer() : nodes[current].text;
+        for (int k = nodes.empty() ? -1 : nodes[current].parent; k >= 0; child = k, k = nodes[k].parent) {
+            if (nodes[k].packed && nodes[k].base == child) {
+                apply_delta(nodes[k], text, false);  // 差量正好相对路径上的子节点
+            } else if (nodes[child].reversible) {
+                apply_delta(nodes[child], text, true);  // 子节点的操作倒着应用
+            } else {
+                text = text_of(k);
+            }
+            path.push_back(text);
+        }
+        stack<LineBuffer> result;
+        for (auto it = path.rbegin(); it != path.rend(); ++it) result.push(*it);
+        return result;
+    }
+
+private:
+    struct Node {
+        long seq = 0;             // 修改编号
+        int parent = -1;
+        vector<int> children;
+        int last_child = -1;      // 最近去过的子节点
+        time_t time = 0;          // 修改时间，0表示未知
+        LineBuffer text;          // 快照；压缩后为空（成为当前节点时暂存还原出的文本）
+        bool packed = false;      // 快照已换成差量
+        bool reversible = false;  // 差量为插入模式的操作（相对父节点），可以倒着应用
+        int base = -1;            // 差量所相对的节点
+        string delta;             // 差量，换出后为空
+        off_t spill_offset = -1;  // 换出到临时文件中的位置
+        size_t spill_length = 0;
+        size_t cost = 0;          // 估计占用的内存
+    };
+
+    // 换出用的临时文件，创建后立即删除，关闭时空间即释放
+    struct SpillFile {
+        int fd = -1;
+        off_t size = 0;
+        ~SpillFile() {
+            if (fd >= 0) close(fd);
+        }
+    };
+
+    // 插入模式的一个操作：在(line, column)处删除erased、插入inserted
+    struct Edit {
+        size_t line, column;
+        string erased, inserted;
+    };
+
+    vector<Node> nodes;
+    vector<int> by_seq;          // 编号 -> 节点
+    int current = 0;
+    time_t change_time = 0;      // 还没记下的修改开始的时间
+    size_t total_cost = 0;
+    shared_ptr<SpillFile> spill;
+    vector<Edit> edits;          // 这一步记录下的操作
+    bool recording = false;      // 这一步的修改到目前为止都经过edit()
+    unsigned long recorded_version = 0;  // 最近一次记录后文本的版本号
+
+    // 从(line, column)开始经过text之后的位置
+    static void advance(size_t& line, size_t& column, const string& text) {
+        size_t newline = text.rfind('\n');
+        if (newline == string::npos) {
+            column += text.size();
+        } else {
+            line += count(text.begin(), text.end(), '\n');
+            column = text.size() - newline - 1;
+        }
+    }
+
+    // 在(line, column)处把remove换成insert，remove与文本对不上时返回false
+    static bool apply_edit(LineBuffer& text, size_t line, size_t column, const string& remove, const string& insert) {
+        size_t breaks = count(remove.begin(), remove.end(), '\n');
+        if (line + breaks >= text.size() || column > text[line].size()) return false;
+        if (breaks == 0 && insert.find('\n') == string::npos) {
+            if (text[line].compare(column, remove.size(), remove) != 0) return false;
+            text.mut(line).replace(column, remove.size(), insert);
+            return true;
+        }
+        string joined = text[line];
+        for (size_t k = 1; k <= breaks; ++k) joined += '\n' + text[line + k];
+        if (joined.compare(column, remove.size(), remove) != 0) return false;
+        joined.replace(column, remove.size(), insert);
+        vector<string> pieces;
+        size_t begin = 0;
+        for (size_t newline; (newline = joined.find('\n', begin)) != string::npos; begin = newline + 1) {
+            pieces.push_back(joined.substr(begin, newline - begin));
+        }
+        pieces.push_back(joined.substr(begin));
+        text.replace(line, line + breaks + 1, std::move(pieces));
+        return true;
+    }
+
+    void record_insert(size_t line, size_t column, const string& inserted) {
+        if (!edits.empty()) {
+            Edit& last = edits.back();
+            size_t end_line = last.line, end_column = last.column;
+            advance(end_line, end_column, last.inserted);
+            if (end_line == line && end_column == column) {
+                last.inserted += inserted;
+                return;
+            }
+        }
+        edits.push_back({line, column, "", inserted});
+    }
+
+    // 删除的文字结束在上一个操作插入的文字之后（退格）时并入上一个操作
+    void record_erase(size_t line, size_t column, const string& erased) {
+        size_t end_line = line, end_column = column;
+        advance(end_line, end_column, erased);
+        if (!edits.empty()) {
+            Edit& last = edits.back();
+            size_t last_line = last.line, last_column = last.column;
+            advance(last_line, last_column, last.inserted);
+            size_t overlap = min(erased.size(), last.inserted.size());
+            if (last_line == end_line && last_column == end_column &&
+                last.inserted.compare(last.inserted.size() - overlap, overlap, erased, erased.size() - overlap, overlap) == 0) {
+                last.inserted.resize(last.inserted.size() - overlap);
+                if (overlap < erased.size()) {
+                    last.erased.insert(0, erased, 0, erased.size() - overlap);
+                    last.line = line;
+                    last.column = column;
+                }
+                if (last.erased.empty() && last.inserted.empty()) edits.pop_back();
+                return;
+            }
+        }
+        edits.push_back({line, column, erased, ""});
+    }
+
+    // 转到节点id，text变为它的文本
+    void move_to(int id, LineBuffer& text) {
+        LineBuffer target = text_of(id);
+        if (nodes[current].packed && current != id) nodes[current].text = LineBuffer();
+        current = id;
+        nodes[id].text = target;
+        text = target;
+    }
+
+    bool has_text(int id) const { return !nodes[id].packed || id == current; }
+
+    // 节点的文本：从id出发，经过差量所相对的节点或可以倒着应用的子节点，广度优先找到最近的有文本的节点
+    // （当前节点总有文本），再沿原路逐个应用差量
+    LineBuffer text_of(int id) const {
+        if (has_text(id)) return nodes[id].text;
+        unordered_map<int, int> from = {{id, -1}};  // 节点 -> 从哪个节点找过来
+        deque<int> queue = {id};
+        int found = -1;
+        auto visit = [&](int next, int k) {
+            if (found >= 0 || !from.emplace(next, k).second) return;
+            if (has_text(next)) {
+                found = next;
+            } else {
+                queue.push_back(next);
+            }
+        };
+        while (!queue.empty() && found < 0) {
+            int k = queue.front();
+            queue.pop_front();
+            if (nodes[k].packed) visit(nodes[k].base, k);
+            for (int child : nodes[k].children) {
+                if (nodes[child].reversible && nodes[child].packed && nodes[child].base == k) visit(child, k);
+            }
+        }
+        if (found < 0) return LineBuffer();
+        LineBuffer text = nodes[found].text;
+        for (int k = found; from[k] >= 0; k = from[k]) {
+            int next = from[k];
+            if (nodes[next].packed && nodes[next].base == k) {
+                apply_delta(nodes[next], text, false);
+            } else {
+                apply_delta(nodes[k], text, true);  // k是next可以倒着应用的子节点
+            }
+        }
+        return text;
+    }
+
+    // 应用节点的差量：把base的文本变为节点的文本；reverse时（只用于插入模式的操作）把节点的文本变回父节点的
+    void apply_delta(const Node& node, LineBuffer& text, bool reverse) const {
+        string spilled;
+        const string* delta = &node.delta;
+        if (node.spill_offset >= 0) {
+            spilled.resize(node.spill_length);
+            if (pread(spill->fd, &spilled[0], node.spill_length, node.spill_offset) != (ssize_t)node.spill_length) return;
+            delta = &spilled;
+        }
+        ByteReader reader(delta->data(), delta->size());
+        if (!node.reversible) {
+            decode_delta(reader, text);
+            return;
+        }
+        uint64_t count;
+        vector<Edit> ops;
+        if (!reader.get_varint(count)) return;
+        for (uint64_t i = 0; i < count; ++i) {
+            uint64_t line, column, erased, inserted;
+            if (!reader.get_varint(line) || !reader.get_varint(column) || !reader.get_varint(erased) || (size_t)(reader.end - reader.p) < erased) return;
+            Edit e = {line, column, string(reader.p, erased), ""};
+            reader.p += erased;
+            if (!reader.get_varint(inserted) || (size_t)(reader.end - reader.p) < inserted) return;
+            e.inserted.assign(reader.p, inserted);
+            reader.p += inserted;
+            ops.push_back(std::move(e));
+        }
+        if (reverse) {
+            for (auto it = ops.rbegin(); it != ops.rend(); ++it) apply_edit(text, it->line, it->column, it->inserted, it->erased);
+        } else {
+            for (const Edit& e : ops) apply_edit(text, e.line, e.column, e.erased, e.inserted);
+        }
+    }
+
+    // 超过预算时从最早的节点开始压缩，仍然超过时换出最早的差量
+    void enforce_budget() {
+        size_t limit = budget;
+        if (limit == 0) return;
+        for (size_t seq = 0; seq < by_seq.size() && total_cost > limit; ++seq) pack(by_seq[seq]);
+        for (size_t seq = 0; seq < by_seq.size() && total_cost > limit; ++seq) spill_out(by_seq[seq]);
+    }
+
+    // 把节点的快照换成差量：相对最新的一个子节点（不能是相对本节点压缩的子节点），没有子节点时相对父节点
+    void pack(int id) {
+        Node& node = nodes[id];
+        if (node.packed || id == current) return;
+        int base = -1;
+        for (int child : node.children) {
+            if (nodes[child].packed && nodes[child].base == id) continue;
+            if (base < 0 || nodes[child].seq > nodes[base].seq) base = child;
+        }
+        if (base < 0 && node.children.empty() && node.parent >= 0 && !(nodes[node.parent].packed && nodes[node.parent].base == id)) {
+            base = node.parent;
+        }
+        if (base < 0) return;
+        ByteWriter w;
+        encode_delta(w, node.text, text_of(base));
+        total_cost -= node.cost;
+        node.cost = w.out.size();
+        total_cost += node.cost;
+        node.delta = std::move(w.out);
+        node.base = base;
+        node.packed = true;
+        node.text = LineBuffer();
+    }
+
+    void spill_out(int id) {
+        Node& node = nodes[id];
+        if (!node.packed || node.delta.empty() || id == current) return;
+        if (!spill) {
+            spill = make_shared<SpillFile>();
+            const char* dir = getenv("TMPDIR");
+            string path = string(dir && *dir ? dir : "/tmp") + "/minivim-undo-XXXXXX";
+            spill->fd = mkstemp(&path[0]);
+            if (spill->fd >= 0) unlink(path.c_str());
+        }
+        if (spill->fd < 0) return;
+        if (pwrite(spill->fd, node.delta.data(), node.delta.size(), spill->size) != (ssize_t)node.delta.size()) return;
+        node.spill_offset = spill->size;
+        node.spill_length = node.delta.size();
+        spill->size += node.delta.size();
+        total_cost -= node.cost;
+        node.cost = 0;
+        string().swap(node.delta);
+    }
+};
+
+// 会话文件（:mksession，-S）：缓冲区列表、各缓冲区的光标和滚动位置、撤销历史，二进制格式，带版本号。
+// 布局为文件头、缓冲区表（每个缓冲区一项定长记录）和记录按偏移引用的数据（文件名、行、撤销历史）。
+// 打开时整个文件用mmap映射，只校验文件头和缓冲区表，各缓冲区的内容在第一次切换过去时才读取。
+// 没有未保存修改、磁盘文件也没变的缓冲区只保存各行的长度（行索引）：恢复时磁盘文件的修改时间和大小与记录相同，
+// 就按行索引直接从映射的文件中切出各行，不再查找换行符；其余缓冲区的行保存在会话文件中
+class Session {
+public:
+    static const uint32_t VERSION = 1;
+    enum : uint32_t {
+        TEXT = 1,      // 行内容保存在会话文件中
+        MODIFIED = 2,  // 有未保存的修改
+        UNLOADED = 4,  // 从未打开过，只有文件名
+    };
+    struct Header {
+        char magic[8];          // "MVSESSN"
+        uint32_t version;
+        uint32_t buffer_count;
+        uint32_t current;       // 当前缓冲区
+        uint32_t reserved;
+        uint64_t file_size;     // 整个会话文件的大小，用来发现没写完整的文件
+    };
+    struct Record {
+        uint64_t name_offset, name_length;
+        uint64_t lines_offset, lines_length;  // 行索引（各行的长度），TEXT时为各行的长度和内容
+        uint64_t line_count;
+        uint64_t undo_offset, undo_length;    // 撤销历史（encode_undo的差量）
+        int64_t mtime_ns, disk_size;          // 行索引对应的磁盘文件
+        int32_t cursor_x, cursor_y, top_line, left_column;
+        uint32_t flags, reserved;
+    };
+    // 写出时的一个缓冲区：source不为空时原样复制source中第source_index项的数据（还没有切换过去的缓冲区）
+    struct Buffer {
+        string name;
+        const LineBuffer* text = nullptr;
+        const stack<LineBuffer>* undo = nullptr;
+        int cursor_x = 0, cursor_y = 0, top_line = 0, left_column = 0;
+        bool modified = false;
+        pair<long long, long long> stamp{-1, -1};  // 内容与磁盘文件一致时为文件的修改时间和大小，否则为{-1, -1}
+        const Session* source = nullptr;
+        size_t source_index = 0;
+    };
+
+    ~Session() {
+        if (data) munmap((void*)data, size);
+    }
+
+    // 映射并校验会话文件
+    bool open(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)) {
+            void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                data = (const char*)mapped;
+                size = st.st_size;
+            }
+        }
+        ::close(fd);
+        if (!data) return false;
+        const Header& h = header();
+        if (memcmp(h.magic, "MVSESSN", 8) != 0 || h.version != VERSION || h.file_size != size) return false;
+        if ((size - sizeof(Header)) / sizeof(Record) < h.buffer_count || (h.buffer_count > 0 && h.current >= h.buffer_count)) return false;
+        for (size_t i = 0; i < h.buffer_count; ++i) {
+            const Record& r = record(i);
+            if (!in_bounds(r.name_offset, r.name_length) || !in_bounds(r.lines_offset, r.lines_length) || !in_bounds(r.undo_offset, r.undo_length)) return false;
+        }
+        return true;
+    }
+
+    size_t buffer_count() const { return header().buffer_count; }
+    size_t current() const { return header().current; }
+    const Record& record(size_t i) const { return ((const Record*)(data + sizeof(Header)))[i]; }
+    string name(size_t i) const { return string(data + record(i).name_offset, record(i).name_length); }
+
+    // 第i个缓冲区的行。按行索引恢复时磁盘文件已变化（或行索引与文件对不上）则返回false
+    bool read_lines(size_t i, LineBuffer& text) const {
+        const Record& r = record(i);
+        ByteReader reader(data + r.lines_offset, r.lines_length);
+        vector<string> lines;
+        if (r.flags & TEXT) {
+            if (!reader.get_lines(r.line_count, lines)) return false;
+        } else {
+            string path = name(i);
+            if (file_stamp(path) != make_pair((long long)r.mtime_ns, (long long)r.disk_size)) return false;
+            if (r.line_count > r.lines_length) return false;
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return false;
+            const char* file = nullptr;
+            if (r.disk_size > 0) {
+                void* mapped = mmap(nullptr, r.disk_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped != MAP_FAILED) file = (const char*)mapped;
+            }
+            ::close(fd);
+            if (!file && r.disk_size > 0) return false;
+            lines.reserve(r.line_count);
+            size_t offset = 0;
+            for (size_t k = 0; k < r.line_count && offset <= (size_t)r.disk_size; ++k) {
+                uint64_t length;
+                if (!reader.get_varint(length) || offset + length > (size_t)r.disk_size) break;
+                lines.emplace_back(file + offset, length);
+                offset += length + 1;
+            }
+            if (file) munmap((void*)file, r.disk_size);
+            // 每行之后一个换行符，最后一行可以没有
+            if (lines.size() != r.line_count || (offset != (size_t)r.disk_size && offset != (size_t)r.disk_size + 1)) return false;
+        }
+        text = LineBuffer();
+        text.insert(0, std::move(lines));
+        if (text.empty()) text.push_back("");
+        return true;
+    }
+
+    // 第i个缓冲区的撤销历史，current为read_lines读出的内容
+    bool read_undo(size_t i, const LineBuffer& current, stack<LineBuffer>& undo) const {
+        const Record& r = record(i);
+        if (r.undo_length == 0) return true;
+        ByteReader reader(data + r.undo_offset, r.undo_length);
+        return decode_undo(reader, current, undo);
+    }
+
+    // 写出会话文件：先写到临时文件再改名，正在映射旧文件的进程不受影响
+    static bool write(const string& path, const vector<Buffer>& buffers, size_t current) {
+        size_t base = sizeof(Header) + buffers.size() * sizeof(Record);
+        vector<Record> records(buffers.size());
+        ByteWriter blob;
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            const Buffer& b = buffers[i];
+            Record& r = records[i];
+            r = Record();
+            if (b.source) {
+                const Record& from = b.source->record(b.source_index);
+                r = from;
+                r.lines_offset = base + blob.out.size();
+                blob.out.append(b.source->data + from.lines_offset, from.lines_length);
+                r.undo_offset = base + blob.out.size();
+                blob.out.append(b.source->data + from.undo_offset, from.undo_length);
+            } else {
+                r.cursor_x = b.cursor_x, r.cursor_y = b.cursor_y, r.top_line = b.top_line, r.left_column = b.left_column;
+                r.flags = b.modified ? (uint32_t)MODIFIED : 0;
+                r.lines_offset = base + blob.out.size();
+                if (!b.text) {
+                    r.flags |= UNLOADED;
+                } else if (b.stamp.first >= 0 && !b.modified) {
+                    r.mtime_ns = b.stamp.first;
+                    r.disk_size = b.stamp.second;
+                    r.line_count = b.text->size();
+                    for (const string& line : *b.text) blob.put_varint(line.size());
+                } else {
+                    r.flags |= TEXT;
+                    r.line_count = b.text->size();
+                    blob.put_lines(*b.text, 0, b.text->size());
+                }
+                r.lines_length = base + blob.out.size() - r.lines_offset;
+                r.undo_offset = base + blob.out.size();
+                if (b.text && b.undo && !b.undo->empty()) encode_undo(blob, *b.undo, *b.text);
+            }
+            r.undo_length = base + blob.out.size() - r.undo_offset;
+            r.name_offset = base + blob.out.size();
+            r.name_length = b.name.size();
+            blob.out += b.name;
+        }
+        Header h = {};
+        memcpy(h.magic, "MVSESSN", 8);
+        h.version = VERSION;
+        h.buffer_count = buffers.size();
+        h.current = current;
+        h.file_size = base + blob.out.size();
+        string temp = path + ".tmp";
+        ofstream file(temp, ios::binary | ios::trunc);
+        if (!file.is_open()) return false;
+        file.write((const char*)&h, sizeof(h));
+        file.write((const char*)records.data(), records.size() * sizeof(Record));
+        file.write(blob.out.data(), blob.out.size());
+        file.close();
+        if (file.fail() || rename(temp.c_str(), path.c_str()) != 0) {
+            unlink(temp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+
+    const Header& header() const { return *(const Header*)data; }
+    bool in_bounds(uint64_t offset, uint64_t length) const { return offset <= size && length <= size - offset; }
+};
+
+// 持久撤销文件：保存文件时把撤销历史写到undodir中与文件对应的撤销文件里，关闭文件或退出后撤销历史仍然保留。
+// 撤销文件由若干段组成，每段是一次保存时内存中的撤销历史：开头为保存时文本的哈希，后面是encode_undo的差量，
+// 新的段在前。一段最早的状态就是后面一段开头的文本，所以从哈希与当前内容相同的段开始可以一直解码到最后。
+// 读入是惰性的：撤销越过内存中最早的状态时才读撤销文件，找不到哈希相同的段（文件被其他程序修改过）时不使用
+class UndoFile {
+public:
+    static const uint32_t VERSION = 1;
+
+    // 文本内容的64位FNV-1a哈希（每行之后算一个换行符）
+    static uint64_t hash(const LineBuffer& text) {
+        uint64_t h = 14695981039346656037ULL;
+        for (const string& line : text) {
+            for (unsigned char c : line) h = (h ^ c) * 1099511628211ULL;
+            h = (h ^ '\n') * 1099511628211ULL;
+        }
+        return h;
+    }
+
+    // 读入撤销文件中比current更早的状态，放入undo（调用时undo为空，撤销已经越过内存中的全部历史）。
+    // 撤销文件不存在、损坏或没有从current开始的段时返回false
+    static bool load(const string& path, const LineBuffer& current, stack<LineBuffer>& undo) {
+        string data;
+        size_t begin;
+        if (!read(path, data) || !find_segment(data, hash(current), begin)) return false;
+        vector<LineBuffer> states;  // 从新到旧
+        LineBuffer text = current;
+        for (size_t pos = begin; pos < data.size();) {
+            uint64_t length;
+            memcpy(&length, &data[pos + 8], sizeof(length));
+            ByteReader reader(&data[pos + SEGMENT_HEADER], length);
+            if (!decode_undo_states(reader, text, states)) return false;
+            pos += SEGMENT_HEADER + length;
+        }
+        for (auto it = states.rbegin(); it != states.rend(); ++it) undo.push(*it);
+        return true;
+    }
+
+    // 写出撤销文件：current为刚保存的文本，undo为内存中的撤销历史，放在新的一段中。append_old时
+    // 旧撤销文件中从内存最早的状态开始的段（旧历史还没读入内存）原样接在后面，不用解码
+    static bool save(const string& path, const LineBuffer& current, const stack<LineBuffer>& undo, bool append_old) {
+        string old_data;
+        size_t begin = 0;
+        bool keep_old = false;
+        if (append_old && read(path, old_data)) {
+            LineBuffer oldest = current;
+            for (stack<LineBuffer> rest = undo; !rest.empty(); rest.pop()) oldest = rest.top();
+            keep_old = find_segment(old_data, hash(oldest), begin);
+        }
+        if (undo.empty() && !keep_old) {
+            unlink(path.c_str());  // 没有可撤销的修改
+            return true;
+        }
+        ByteWriter w;
+        w.out.append("MVUNDO\0\0", 8);
+        w.put<uint32_t>(VERSION);
+        w.put<uint32_t>(0);
+        if (!undo.empty()) {
+            w.put<uint64_t>(hash(current));
+            size_t length_at = w.out.size();
+            w.put<uint64_t>(0);
+            encode_undo(w, undo, current);
+            uint64_t length = w.out.size() - length_at - sizeof(uint64_t);
+            memcpy(&w.out[length_at], &length, sizeof(length));
+        }
+        if (keep_old) w.out.append(old_data, begin, string::npos);
+        if (!make_directories(path.substr(0, path.rfind('/')))) return false;
+        string temp = path + ".tmp";
+        ofstream file(temp, ios::binary | ios::trunc);
+        if (!file.is_open()) return false;
+        file.write(w.out.data(), w.out.size());
+        file.close();
+        if (file.fail() || rename(temp.c_str(), path.c_str()) != 0) {
+            unlink(temp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static const size_t FILE_HEADER = 16;     // 魔数8字节、版本、保留
+    static const size_t SEGMENT_HEADER = 16;  // 开头文本的哈希、差量的字节数
+
+    // 读入整个撤销文件，校验文件头和各段的长度
+    static bool read(const string& path, string& data) {
+        ifstream file(path, ios::binary);
+        if (!file.is_open()) return false;
+        data.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        uint32_t version;
+        if (data.size() < FILE_HEADER || memcmp(data.data(), "MVUNDO\0\0", 8) != 0) return false;
+        memcpy(&version, &data[8], sizeof(version));
+        if (version != VERSION) return false;
+        for (size_t pos = FILE_HEADER; pos < data.size();) {
+            uint64_t length;
+            if (data.size() - pos < SEGMENT_HEADER) return false;
+            memcpy(&length, &data[pos + 8], sizeof(length));
+            if (length > data.size() - pos - SEGMENT_HEADER) return false;
+            pos += SEGMENT_HEADER + length;
+        }
+        return true;
+    }
+
+    // 开头文本的哈希为text_hash的段的位置
+    static bool find_segment(const string& data, uint64_t text_hash, size_t& begin) {
+        for (size_t pos = FILE_HEADER; pos < data.size();) {
+            uint64_t h, length;
+            memcpy(&h, &data[pos], sizeof(h));
+            memcpy(&length, &data[pos + 8], sizeof(length));
+            if (h == text_hash) {
+                begin = pos;
+                return true;
+            }
+            pos += SEGMENT_HEADER + length;
+        }
+        return false;
+    }
+
+    // mkdir -p
+    static bool make_directories(const string& dir) {
+        if (dir.empty() || access(dir.c_str(), F_OK) == 0) return true;
+        size_t slash = dir.rfind('/');
+        if (slash != string::npos && slash > 0 && !make_directories(dir.substr(0, slash))) return false;
+        return mkdir(dir.c_str(), 0700) == 0 || errno == EEXIST;
+    }
+};
+
+class MiniVim {
+public:
+    // 构造函数，初始化MiniVim对象。headless为true时用于脚本模式，不使用ncurses
+    MiniVim(const vector<string>& filenames, bool headless = false)
+    : cursor_x(0), cursor_y(0), top_line(0), left_column(0), insert_mode_active(false), command_mode_active(false), headless(headless) {
+        file_history = filenames;
+        arg_count = filenames.size();
+        buffers.resize(file_history.size());
+        events.on_file_change = [this](const string& path) { file_changed(path); };
+        current_file_index = 0;  // 默认加载第一个文件
+        if (!file_history.empty()) loadFile();  // 加载第一个文件
+        views.push_back(make_unique<View>());
+        active_view = views.back().get();
+        layout_root = make_unique<Frame>();
+        layout_root->view = active_view;
+        active_view->frame = layout_root.get();
+        relayout();
+    }
+
+    // 析构函数，等待后台保存完成并结束ncurses模式
+    ~MiniVim() {
+        finish_save();
+        finish_jobs();
+        stop_server();
+        if (!headless) endwin();
+    }
+
+    // 主循环，处理用户输入和界面更新
+    void run() {
+        while (true) {
+            check_autosave(); // 到时间则触发自动保存
+            expire_pending_keys();  // 多键序列超时作废
+            if (resize_pending && resize_settled()) apply_resize();
+            if (input_queue.empty() && replay_frames.empty()) {
+                if (!resize_pending) draw();  // 输入队列和宏回放都处理完后才重绘一次，终端尺寸还在变化时不画
+                read_input();  // 获取用户输入
+            }
+            int ch;
+            while (take_queued_key(ch)) {
+                dispatch_key(ch);
+                if (command_failed) {
+                    command_failed = false;
+                    replay_frames.clear();  // 命令失败时中止宏回放
+                }
+            }
+        }
+    }
+
+    // 从宏回放或输入队列中取出下一个按键；录制宏时记录用户输入的按键
+    bool take_queued_key(int& ch) {
+        while (!replay_frames.empty()) {
+            ReplayFrame& frame = replay_frames.back();
+            if (frame.pos == frame.keys->size()) {
+                if (--frame.remaining <= 0) {
+                    replay_frames.pop_back();
+                    continue;
+                }
+                frame.pos = 0;
+            }
+            ch = (*frame.keys)[frame.pos++];
+            // 长时间回放时定期检查是否按下了Ctrl+c
+            if ((++replayed_keys & 4095) == 0 && interrupt_requested()) {
+                replay_frames.clear();
+                status_message = "Interrupted";
+                return false;
+            }
+            return true;
+        }
+        if (input_queue.empty()) return false;
+        ch = input_queue.front();
+        input_queue.pop_front();
+        if (recording_register) recorded_keys.push_back(ch);
+        return true;
+    }
+
+    // 非阻塞地读取已到达的输入，发现Ctrl+c则返回true，其余按键留在输入队列中
+    bool interrupt_requested() {
+        timeout(0);
+        int key;
+        bool interrupted = false;
+        while ((key = getch()) != ERR) {
+            if (key == 3) interrupted = true; else input_queue.push_back(key);
+        }
+        return interrupted;
+    }
+    
+    // 按当前模式分发一个按键
+    void dispatch_key(int ch) {
+        if (finder_active) {
+            finder_mode(ch);  // 处理 :files 查找界面的输入
+        } else if (command_mode_active) {
+            command_mode(ch);  // 处理命令模式输入
+        } else if (insert_mode_active) {
+            insert_mode(ch);  // 处理插入模式输入
+        } else {
+            normal_mode(ch);  // 处理普通模式输入
+        }
+    }
+
+    // 没有输入时下一次需要醒来的时刻，没有则为time_point::max()（一直等待）
+    chrono::steady_clock::time_point next_wakeup() const {
+        auto now = chrono::steady_clock::now();
+        auto wake = chrono::steady_clock::time_point::max();
+        if (save_state != SAVE_IDLE) {
+            wake = now + chrono::milliseconds(100);  // 刷新保存进度
+        } else if (autosave_interval > 0) {
+            wake = last_autosave + chrono::seconds(autosave_interval);  // 自动保存
+        }
+        if (resize_pending) {  // 等尺寸不再变化后重新布局
+            wake = min(wake, min(resize_last + chrono::milliseconds(resize_settle_ms), resize_first + chrono::milliseconds(resize_max_delay_ms)));
+        }
+        if (has_pending_keys()) {
+            wake = min(wake, pending_since + chrono::milliseconds(timeoutlen));  // 多键序列超时
+        }
+        return wake;
+    }
+
+    // 读取输入：在事件循环中等待第一个按键（其间执行后台投递的任务），再把已经到达的预输入（typeahead）一并放入输入队列。
+    // 因定时、任务或文件变化醒来时直接返回
+    void read_input() {
+        timeout(0);
+        int key = getch();  // ncurses可能还缓存着上一次解析转义序列时多读的按键
+        if (key == ERR) {
+            if (!events.wait(next_wakeup())) return;
+            if ((key = getch()) == ERR) return;
+        }
+        do {
+            if (key == KEY_RESIZE) {
+                note_resize();  // 终端尺寸变化不是按键，不进入输入队列
+            } else {
+                input_queue.push_back(key);
+            }
+            timeout(0);
+        } while ((key = getch()) != ERR);
+    }
+
+    // 收到KEY_RESIZE（ncurses已按新尺寸调整了stdscr）：记下新尺寸，重新布局推迟到尺寸不再变化时，
+    // 拖动窗口边框时连续的尺寸变化只重新布局、重画一次
+    void note_resize() {
+        getmaxyx(stdscr, screen_height, screen_width);
+        auto now = chrono::steady_clock::now();
+        if (!resize_pending) resize_first = now;
+        resize_last = now;
+        resize_pending = true;
+    }
+
+    // 最后一次尺寸变化后已经安静了resize_settle_ms，或者从第一次变化起已经推迟了resize_max_delay_ms
+    bool resize_settled() const {
+        auto now = chrono::steady_clock::now();
+        return now - resize_last >= chrono::milliseconds(resize_settle_ms) || now - resize_first >= chrono::milliseconds(resize_max_delay_ms);
+    }
+
+    // 按当前终端尺寸重新布局：只重新计算各窗口的位置和大小，并让每个窗口的光标保持可见，之后整屏重画一次
+    void apply_resize() {
+        resize_pending = false;
+        // 尺寸变回原样时也要整屏重画：中间每次KEY_RESIZE时ncurses已经按当时的尺寸截断了stdscr
+        relayout();
+        for (auto& view : views) {
+            if (view.get() == active_view) continue;
+            if (view->cursor_y >= view->top_line + view->height) view->top_line = view->cursor_y - view->height + 1;
+            if (view->cursor_x >= view->left_column + view->width - 10) view->left_column = max(0, view->cursor_x - (view->width - 11));
+        }
+    }
+
+    // 取下一个按键：优先从输入队列取，队列为空时阻塞读取
+    int next_key() {
+        int key;
+        if (take_queued_key(key)) return key;
+        timeout(0);
+        while ((key = getch()) == ERR) {
+            events.wait(chrono::steady_clock::time_point::max());
+        }
+        if (key == KEY_RESIZE) {
+            note_resize();
+            return key;
+        }
+        if (recording_register) recorded_keys.push_back(key);
+        return key;
+    }
+
+    // 脚本模式入口：每个文件由一个独立的MiniVim实例执行同一份命令脚本，
+    // 多个文件在线程池中并行处理。脚本中用 :n、:N、:e、:b 切换文件时，改为由一个实例对整个文件列表
+    // 顺序执行一遍脚本（与vim相同）。出错信息按文件顺序输出到stderr，有错误时返回1
+    static int run_script(const vector<string>& filenames, const vector<string>& commands, size_t jobs) {
+        vector<vector<string>> errors(filenames.size());
+        if (switches_files(commands)) {
+            errors.resize(1);
+            try {
+                MiniVim editor(filenames, true);
+                errors[0] = editor.run_commands(commands);
+            } catch (const exception& e) {
+                errors[0].push_back(e.what());
+            }
+        } else {
+            ThreadPool pool(min(jobs, filenames.size()));
+            for (size_t i = 0; i < filenames.size(); ++i) {
+                pool.submit([&, i]() {
+                    try {
+                        MiniVim editor({filenames[i]}, true);
+                        errors[i] = editor.run_commands(commands);
+                    } catch (const exception& e) {
+                        errors[i].push_back(filenames[i] + ": " + e.what());
+                    }
+                });
+            }
+        }  // 线程池析构时等待所有文件处理完
+        int status = 0;
+        for (const auto& file_errors : errors) {
+            for (const string& message : file_errors) {
+                fprintf(stderr, "%s\n", message.c_str());
+                status = 1;
+            }
+        }
+        return status;
+    }
+
+    // 脚本中是否有切换当前文件的命令（:n、:N、:e 文件、:b 编号）
+    static bool switches_files(const vector<string>& commands) {
+        for (const string& line : commands) {
+            size_t begin = line.find_first_not_of(" \t:");
+            if (begin == string::npos || line[begin] == '"') continue;
+            string command = line.substr(begin);
+            if (command == "n" || command == "N" || command.rfind("e ", 0) == 0 || command.rfind("b ", 0) == 0) return true;
+        }
+        return false;
+    }
+
+    // 初始化ncurses环境
+    void init() {
+        initscr();  // 初始化屏幕
+        keypad(stdscr, TRUE);  // 启用键盘功能键
+        set_escdelay(ttimeoutlen);  // ESC与功能键转义序列的区分时间
+        noecho();  // 关闭输入回显
+        cbreak();  // 禁用行缓冲
+        raw();  // 禁用Ctrl+C等信号
+        curs_set(TRUE);  // 显示光标
+        if (has_colors()) {  // 差异模式的高亮
+            start_color();
+            use_default_colors();
+            init_pair(1, -1, COLOR_MAGENTA);  // 两侧都有但内容不同的行
+            init_pair(2, -1, COLOR_BLUE);     // 只有这一侧有的行
+            init_pair(3, COLOR_CYAN, -1);     // 填充行
+        }
+        getmaxyx(stdscr, screen_height, screen_width);  // 获取屏幕尺寸
+        relayout();
+        refresh();  // 刷新屏幕
+    }
+
+    // -d：并排比较命令行上的前两个文件
+    void start_diff() {
+        switch_to_file(1);
+        switch_to_file(0);
+        diff_files = {0, 1};
+        diff_update();
+    }
+
+    // -S：从会话文件恢复缓冲区列表。只恢复当前缓冲区，其他缓冲区在第一次切换过去时才读取。
+    // 命令行上另外给出的文件加在列表后面，并打开其中的第一个
+    bool load_session(const string& path, const vector<string>& extra) {
+        auto loaded = make_shared<Session>();
+        if (!loaded->open(path) || loaded->buffer_count() == 0) return false;
+        session = loaded;
+        session_path = path;
+        file_history.clear();
+        for (size_t i = 0; i < session->buffer_count(); ++i) file_history.push_back(session->name(i));
+        buffers.assign(file_history.size(), BufferState());
+        for (size_t i = 0; i < buffers.size(); ++i) buffers[i].session_record = i;
+        arg_count = file_history.size();
+        restore_buffer(session->current());
+        for (const string& name : extra) {
+            if (find(file_history.begin(), file_history.end(), name) == file_history.end()) file_history.push_back(name);
+        }
+        if (!extra.empty()) open_file(extra[0]);
+        active_view->file = current_file_index;
+        return true;
+    }
+
+    // 服务器套接字的默认路径：$XDG_RUNTIME_DIR下，没有时为/tmp下按用户区分的文件
+    static string default_server_path() {
+        const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+        if (runtime_dir && *runtime_dir) return string(runtime_dir) + "/minivim-server";
+        return "/tmp/minivim-" + to_string(getuid()) + ".sock";
+    }
+
+    // 撤销文件的默认目录：$XDG_STATE_HOME/minivim/undo，没有该变量时为~/.local/state/minivim/undo
+    static string default_undo_dir() {
+        const char* state_home = getenv("XDG_STATE_HOME");
+        if (state_home && *state_home) return string(state_home) + "/minivim/undo";
+        const char* home = getenv("HOME");
+        if (home && *home) return string(home) + "/.local/state/minivim/undo";
+        return "";
+    }
+
+    // --server：在Unix域套接字上接受 --remote 的请求。已有服务器在这个路径上运行时返回false
+    bool start_server(const string& path) {
+        int probe = connect_server(path);
+        if (probe >= 0) {
+            close(probe);
+            return false;
+        }
+        sockaddr_un addr = {};
+        if (path.size() >= sizeof(addr.sun_path)) return false;
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        unlink(path.c_str());  // 上次没有正常退出留下的套接字文件
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return false;
+        // 套接字文件只允许自己读写，连接时再核对对方的用户
+        if (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || chmod(path.c_str(), 0600) != 0 || listen(fd, 64) != 0) {
+            close(fd);
+            unlink(path.c_str());
+            return false;
+        }
+        server_fd = fd;
+        server_socket = path;
+        events.add_reader(fd, [this]() { accept_clients(); });
+        return true;
+    }
+
+    // --remote：把文件交给path上正在运行的服务器打开，等服务器打开后返回true；没有服务器时返回false。
+    // 请求为客户端的当前目录和各个文件名，以'\0'分隔，写完后关闭写方向；服务器打开文件后回复并关闭连接
+    static bool remote_open(const string& path, const vector<string>& files) {
+        int fd = connect_server(path);
+        if (fd < 0) return false;
+        char cwd[PATH_MAX];
+        string request = getcwd(cwd, sizeof(cwd)) ? cwd : ".";
+        for (const string& file : files) {
+            request += '\0';
+            request += file;
+        }
+        for (size_t sent = 0; sent < request.size(); ) {
+            ssize_t n = write(fd, request.data() + sent, request.size() - sent);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            sent += n;
+        }
+        shutdown(fd, SHUT_WR);
+        char reply[64];
+        bool answered = false;
+        ssize_t n;
+        while ((n = read(fd, reply, sizeof(reply))) > 0 || (n < 0 && errno == EINTR)) answered = answered || n > 0;
+        close(fd);
+        return answered;
+    }
+
+private:
+    vector<string> file_history; // 文件历史列表
+    size_t current_file_index;   // 当前文件的索引
+    size_t arg_count = 0;        // 命令行给出的文件数（file_history的前arg_count个，:argdo的范围）
+    string filename;             // 当前文件名
+    LineBuffer lines;            // 当前文件内容
+    int cursor_x = 0, cursor_y = 0;  // 光标位置
+    int top_line = 0, left_column = 0;  // 窗口滚动位置
+    int screen_width = 80, screen_height = 24;  // 屏幕尺寸（脚本模式下保持默认值）
+
+    // 分割窗口：每个窗口显示一个缓冲区，有自己的光标和滚动位置，并记住上次绘制时的内容，
+    // 重绘时只重画内容、滚动位置或光标发生了变化的屏幕行
+    struct Frame;
+    struct View {
+        size_t file = 0;                    // 显示的缓冲区（file_history下标）
+        int cursor_x = 0, cursor_y = 0;     // 非活动窗口的光标和滚动位置，活动窗口以MiniVim的成员为准
+        int top_line = 0, left_column = 0;
+        int row = 0, col = 0, height = 1, width = 1;  // 文本区在屏幕上的位置和大小，有多个窗口时下面还有一行状态行
+        Frame* frame = nullptr;             // 布局树中的叶子
+        LineBuffer painted;                 // 上次绘制时缓冲区的快照
+        size_t painted_file = 0;            // 上次绘制的缓冲区
+        int painted_top = -1, painted_left = -1;  // 上次绘制时的滚动位置，-1表示需要整个重画
+        int painted_cursor = -1;            // 上次绘制光标的屏幕行，-1表示没有光标
+        bool painted_visual = false;        // 上次绘制时有可视模式的选区
+        string painted_status;              // 上次绘制的状态行
+    };
+    // 布局树：叶子是一个窗口，内部节点的子节点左右并排（:vsplit）或上下排列（:split），平分空间
+    struct Frame {
+        View* view = nullptr;
+        bool vertical = false;
+        int row = 0, col = 0, height = 0, width = 0;  // 在屏幕上占据的范围（含状态行）
+        vector<unique_ptr<Frame>> children;
+        Frame* parent = nullptr;
+    };
+    vector<unique_ptr<View>> views;
+    unique_ptr<Frame> layout_root;
+    View* active_view = nullptr;
+    bool screen_stale = true;           // 屏幕被清除或布局改变，所有窗口需要整个重画
+    bool resize_pending = false;        // 收到了终端尺寸变化，还没有重新布局
+    chrono::steady_clock::time_point resize_first, resize_last;  // 这一串尺寸变化中第一次和最后一次的时间
+    static constexpr int resize_settle_ms = 30;       // 尺寸这么久不变才重新布局
+    static constexpr int resize_max_delay_ms = 150;   // 持续变化时最多推迟这么久
+    bool insert_mode_active;  // 插入模式是否激活
+    bool command_mode_active;  // 命令模式是否激活
+    string command_buffer;  // 命令缓冲区
+    // 寄存器内容：按行、按字符或按列（块）复制的文本，与缓冲区共享存储
+    enum { REG_LINE, REG_CHAR, REG_BLOCK };
+    struct Register {
+        LineBuffer text;
+        int type = REG_LINE;
+    };
+    map<char, Register> registers;  // 寄存器：'"'为无名寄存器，'a'-'z'为命名寄存器
+    char pending_register = 0;  // 通过 "x 指定的寄存器
+    UndoTree undo_tree;     // 撤销树，节点为整个文本的状态（写时复制快照）
+    string status_message;  // 状态栏提示信息
+
+    // 后台保存
+    enum { SAVE_IDLE, SAVE_RUNNING, SAVE_DONE, SAVE_FAILED };
+    thread save_thread;                 // 保存线程
+    atomic<int> save_state{SAVE_IDLE};  // 保存状态
+    atomic<size_t> save_progress{0};    // 已写出的行数
+    size_t save_total = 0;              // 快照总行数
+    string save_target;                 // 正在保存的文件名
+    unsigned long save_version = 0;     // 正在保存的快照版本
+    unsigned long saved_version = 0;    // 最近一次成功保存（或加载）的版本
+    chrono::steady_clock::time_point save_started;
+    atomic<long> save_elapsed_ms{0};    // 写出耗时
+    int autosave_interval = 0;          // 自动保存间隔（秒），0表示关闭
+    chrono::steady_clock::time_point last_autosave = chrono::steady_clock::now();
+
+    // 按键输入
+    deque<int> input_queue;             // 待处理的按键
+    vector<int> pending_keys;           // 普通模式下未完成的按键序列
+    int pending_count = 0;              // 计数前缀
+    chrono::steady_clock::time_point pending_since;  // 最近一次收到序列按键的时间
+    int timeoutlen = 1000;              // 多键序列的等待时间（毫秒）
+    int ttimeoutlen = 50;               // 终端转义序列的等待时间（毫秒）
+
+    // 可视模式
+    enum { VISUAL_NONE, VISUAL_CHAR, VISUAL_LINE, VISUAL_BLOCK };
+    int visual_mode = VISUAL_NONE;      // 当前可视模式（v / V / Ctrl+v）
+    int visual_start_x = 0, visual_start_y = 0;  // 选区起点
+    enum { BLOCK_INSERT, BLOCK_APPEND, BLOCK_CHANGE };
+    int block_insert_first = -1, block_insert_last = -1;  // 按列插入涉及的行，-1表示没有进行中的按列插入
+    int block_insert_column = 0, block_insert_mode = BLOCK_INSERT;
+    size_t block_insert_length = 0;     // 开始插入时第一行的长度
+    int shiftwidth = 4;                 // 缩进宽度
+
+    // 命令表的一项：按键序列 -> 处理函数，处理函数的参数为计数前缀（未输入计数时为0）
+    typedef void (MiniVim::*NormalHandler)(int count);
+    struct KeyBinding {
+        vector<int> keys;
+        NormalHandler handler;
+        bool takes_argument = false;  // 是否还需要再读一个按键作为参数（如 "a、qa、@a 中的寄存器名）
+    };
+
+    // 宏
+    const KeyBinding* awaiting_argument = nullptr;  // 已匹配、等待参数按键的命令
+    int pending_argument = 0;           // 命令的参数按键
+    char recording_register = 0;        // 正在录制的寄存器，0表示未录制
+    vector<int> recorded_keys;          // 录制中的按键
+    map<char, shared_ptr<const vector<int>>> macros;  // 各寄存器中录制的宏
+    struct ReplayFrame {
+        shared_ptr<const vector<int>> keys;  // 回放的按键序列
+        size_t pos;                          // 下一个按键的位置
+        int remaining;                       // 剩余回放次数
+    };
+    vector<ReplayFrame> replay_frames;  // 宏回放栈（宏中可以调用其他宏）
+    int last_macro = 0;                 // 上一次回放的宏，供@@使用
+    string last_command;                // 上一条命令行，供@:使用
+    bool command_failed = false;        // 本次命令执行失败（用于中止宏）
+    unsigned long replayed_keys = 0;    // 已回放的按键数
+    bool undo_group_saved = false;      // 本次宏回放或:g执行是否已保存撤销状态
+
+    // ex命令
+    struct ExRange { int first = 0, last = 0, count = 0; };  // 行范围（行号从1开始），count为给出的地址个数
+    int visual_mark_first = -1, visual_mark_last = -1;  // '< 和 '> 标记的行，-1表示未设置
+    bool global_active = false;         // 正在执行 :g
+    vector<int> global_marks;           // :g 标记的行（加上global_offset为实际行号，保持有序）
+    vector<char> global_deleted;        // 标记的行已被删除
+    size_t global_next = 0;             // 下一个待处理的标记
+    int global_offset = 0;              // 所有待处理标记的公共偏移
+
+    // 缓冲区状态：切换文件时当前文件的内容、撤销历史和光标位置保存在这里，切换回来时恢复
+    struct BufferState {
+        bool loaded = false;            // 是否保存过状态（否则切换时从磁盘加载）
+        LineBuffer lines;
+        UndoTree undo_tree;
+        unsigned long saved_version = 0;
+        int cursor_x = 0, cursor_y = 0, top_line = 0, left_column = 0;
+        LineBuffer indexed;             // 关键字索引中该文件对应的内容
+        long session_record = -1;       // 还没有切换过去的会话缓冲区在会话文件中的序号
+        bool undo_file_read = false;
+    };
+    vector<BufferState> buffers;        // 与file_history一一对应，当前文件的状态在成员变量中
+    size_t substitute_count = 0;        // :s 累计替换的次数（:bufdo 汇总用）
+
+    // quickfix列表（:vimgrep的结果）
+    struct QuickfixEntry {
+        string filename;
+        int line, column;  // 从0开始
+        string text;
+    };
+    vector<QuickfixEntry> quickfix;
+    size_t quickfix_index = 0;          // 当前项
+    vector<string> bufdo_summary;       // 上一次 :bufdo / :argdo 每个文件的结果
+
+    // 关键字补全
+    KeywordIndex keyword_index;         // 所有缓冲区的单词
+    LineBuffer indexed_lines;           // 关键字索引中当前文件对应的内容，与lines比较得到需要同步的行
+    bool completing = false;            // 正在Ctrl+N/Ctrl+P补全
+    int completion_start = 0;           // 被补全单词的起始列
+    string completion_prefix;           // 补全前输入的前缀
+    string completion_word;             // 当前选中的候选，空表示回到了前缀
+
+    // 标签跳转
+    string tags_path = "tags";          // 标签文件（:set tags=）
+    TagFile tag_file;
+    vector<TagFile::Tag> tag_matches;   // 上一次 :tag 找到的所有位置
+    size_t tag_match_index = 0;
+    struct TagStackEntry {
+        string file;
+        int x, y;
+    };
+    vector<TagStackEntry> tag_stack;    // 跳转前的位置，Ctrl+T返回
+
+    FileFinder file_finder;             // :files 的文件列表缓存
+    bool finder_active = false;         // 正在 :files 的查找界面中，按键由finder_mode处理
+    string finder_query;                // 查找界面中输入的查询
+    size_t finder_selected = 0;         // 选中的是第几个结果
+    vector<uint32_t> finder_best;       // 当前查询得分最高的文件，finder_rows为0时需要重新匹配
+    size_t finder_total = 0, finder_rows = 0;
+
+    // 差异模式
+    LineDiff diff;                      // 两个缓冲区的比较结果
+    vector<size_t> diff_files;          // :diffthis 加入比较的缓冲区（file_history下标）
+
+    // 事件循环
+    EventLoop events;                   // 等待输入、定时、后台任务和文件变化
+    map<string, pair<long long, long long>> disk_stamps;  // 打开的文件最近一次读入或写出时的修改时间和大小
+    bool autoread = false;              // 文件在磁盘上被修改且缓冲区没有未保存的修改时自动重新读入
+
+    // 持久撤销
+    bool undofile = true;               // 保存时写出撤销文件（:set noundofile关闭）
+    string undo_dir = default_undo_dir();  // 撤销文件所在的目录（:set undodir=）
+    bool undo_file_read = false;        // 当前缓冲区的撤销文件已读入内存（或已确认不适用）
+    string save_undo_path;              // 正在保存的文件对应的撤销文件，空表示不写
+    atomic<bool> save_undo_ok{true};    // 撤销文件是否写出成功
+
+    // 异步外部命令（:!、:r !、:job）：读取线程把子进程的输出按行切分后积累在batch中，
+    // 只在主线程没有待取的批次时才投递一次插入任务，所以每轮事件循环（每次重画）把积累的行一次插入缓冲区
+    struct Job {
+        int id;
+        string command;
+        pid_t pid;
+        int fd;                         // 子进程标准输出和标准错误的管道读端
+        size_t file;                    // 输出插入的缓冲区（file_history下标）
+        size_t line;                    // 下一批插入的位置（seen中的行号）
+        bool replace_empty;             // 缓冲区开始时只有一个空行，第一批替换它
+        bool scratch;                   // 输出到 "!命令" 缓冲区（结束后不算未保存的修改）
+        size_t received = 0;            // 已插入的行数
+        LineBuffer seen;                // 开始时或上一批插入后的缓冲区，与插入时的内容比较得出其间的修改
+        long undo_seq = -1;             // 上一批插入记成的撤销节点（:r !），之后缓冲区没有别的修改时下一批并入其中
+        bool detached = false;          // 目标缓冲区撤销过，之后到达的输出丢弃
+        thread reader;
+        mutex lock;                     // 保护以下三项
+        vector<string> batch;           // 已读到、尚未插入的行
+        bool posted = false;            // 已投递插入任务，主线程还没有取走batch
+        int status = -1;                // 子进程结束后的waitpid状态，-1表示还在运行
+    };
+    vector<unique_ptr<Job>> jobs;       // 运行中的命令
+    int next_job_id = 1;
+
+    // 会话（:mksession，-S）
+    shared_ptr<Session> session;        // -S 恢复的会话文件（映射着，缓冲区第一次切换过去时从中恢复）
+    string session_path = ".minivim-session";  // 退出时自动保存会话的文件
+
+    // 服务器模式（--server）
+    int server_fd = -1;                 // 监听的Unix域套接字
+    string server_socket;               // 套接字路径，退出时删除
+
+    // 脚本模式（-s / -es）
+    bool headless = false;              // 不初始化ncurses，只执行命令
+    bool quit_requested = false;        // 脚本中执行了 :q / :wq
+
+    // 读入文件的所有行，文件不存在时为一个空行
+    static LineBuffer read_lines(const string& path) {
+        LineBuffer result;
+        ifstream file(path);
+        if (file.is_open()) {
+            string line;
+            while (getline(file, line)) {
+                result.push_back(line);
+            }
+            file.close();
+        }
+        if (result.empty()) result.push_back("");
+        return result;
+    }
+
+    // 加载当前文件
+    void loadFile() {
+        filename = file_history[current_file_index];
+        lines = read_lines(filename);
+        saved_version = lines.version();
+        undo_tree.reset(lines);
+        undo_file_read = false;
+        track_file();
+    }
+
+    // 当前文件的内容刚读入：后台统计单词（同时去掉索引中这个位置原来的内容），
+    // 记下磁盘文件的修改时间并监视它的变化
+    void track_file() {
+        if (!headless) {
+            keyword_index.update_async(indexed_lines, lines);
+            indexed_lines = lines;
+            disk_stamps[filename] = file_stamp(filename);
+            events.watch(filename);  // 文件在磁盘上被修改时得到通知
+        }
+    }
+
+    // 第一次切换到会话中的第record个缓冲区：恢复内容、撤销历史和光标位置。
+    // 磁盘文件在保存会话之后被修改过时改为从磁盘读入，撤销历史与新的内容对不上，不再恢复
+    void restore_session_buffer(size_t record) {
+        const Session::Record& saved = session->record(record);
+        filename = file_history[current_file_index];
+        undo_file_read = false;
+        if ((saved.flags & Session::UNLOADED) || !session->read_lines(record, lines)) {
+            loadFile();
+            if (!(saved.flags & Session::UNLOADED)) status_message = "\"" + filename + "\" changed since the session was saved, undo history dropped";
+        } else {
+            stack<LineBuffer> history;
+            undo_tree.reset(lines);
+            if (session->read_undo(record, lines, history)) undo_tree.prepend(history);
+            saved_version = (saved.flags & Session::MODIFIED) ? 0 : lines.version();
+            track_file();
+        }
+        cursor_y = min<int>(max(0, saved.cursor_y), lines.size() - 1);
+        cursor_x = max(0, saved.cursor_x);
+        top_line = max(0, saved.top_line);
+        left_column = max(0, saved.left_column);
+        adjust_window();
+    }
+
+    // 把缓冲区列表、光标和滚动位置、撤销历史写入会话文件。内容与磁盘文件一致的缓冲区只写行索引；
+    // 还没有切换过去的会话缓冲区原样复制原来的数据；命令输出的缓冲区（"!命令"）不保存
+    bool write_session(const string& path) {
+        buffers.resize(file_history.size());
+        vector<Session::Buffer> list;
+        deque<stack<LineBuffer>> histories;  // 各缓冲区当前分支上的撤销历史
+        size_t current = 0;
+        undo_tree.commit(lines);
+        auto describe = [&](Session::Buffer& b, const LineBuffer& text, const UndoTree& undo, unsigned long saved) {
+            histories.push_back(undo.history());
+            b.text = &text;
+            b.undo = &histories.back();
+            b.modified = text.version() != saved;
+            auto known = disk_stamps.find(b.name);
+            if (!b.modified && known != disk_stamps.end() && known->second == file_stamp(b.name)) b.stamp = known->second;
+        };
+        for (size_t i = 0; i < file_history.size(); ++i) {
+            if (file_history[i].empty() || file_history[i][0] == '!') continue;
+            Session::Buffer b;
+            b.name = file_history[i];
+            const BufferState& buffer = buffers[i];
+            if (i == current_file_index) {
+                current = list.size();
+                describe(b, lines, undo_tree, saved_version);
+                b.cursor_x = cursor_x, b.cursor_y = cursor_y, b.top_line = top_line, b.left_column = left_column;
+            } else if (buffer.loaded) {
+                describe(b, buffer.lines, buffer.undo_tree, buffer.saved_version);
+                b.cursor_x = buffer.cursor_x, b.cursor_y = buffer.cursor_y, b.top_line = buffer.top_line, b.left_column = buffer.left_column;
+            } else if (buffer.session_record >= 0 && session) {
+                b.source = session.get();
+                b.source_index = buffer.session_record;
+            }
+            list.push_back(b);
+        }
+        return Session::write(path, list, current);
+    }
+
+    // :mksession[!] [文件]：保存会话，文件默认为退出时自动保存的会话文件；文件已存在时需要加 !
+    void make_session(const string& arg) {
+        bool force = !arg.empty() && arg[0] == '!';
+        size_t begin = arg.find_first_not_of(' ', force ? 1 : 0);
+        string path = begin == string::npos ? session_path : arg.substr(begin);
+        if (!force && begin != string::npos && access(path.c_str(), F_OK) == 0) {
+            status_message = "E189: \"" + path + "\" exists (add ! to override)";
+            command_failed = true;
+            return;
+        }
+        if (!write_session(path)) {
+            status_message = "E190: Cannot open \"" + path + "\" for writing";
+            command_failed = true;
+            return;
+        }
+        session_path = path;
+        status_message = "Session saved to \"" + path + "\"";
+    }
+
+    // 打开的文件在磁盘上被修改（inotify通知）。修改时间和大小与记录的相同（例如自己保存引起的通知）时忽略；
+    // 缓冲区没有未保存的修改且设置了autoread时重新读入（可以撤销），否则提示文件已改变
+    void file_changed(const string& path) {
+        if (save_state != SAVE_IDLE && save_target == path) return;  // 正在保存，由poll_save记录结果
+        auto stamp = file_stamp(path);
+        auto known = disk_stamps.find(path);
+        if (known != disk_stamps.end() && known->second == stamp) return;
+        disk_stamps[path] = stamp;
+        if (path == filename) {
+            if (autoread && lines.version() == saved_version) {
+                undo_tree.checkpoint(lines);
+                lines = read_lines(path);
+                saved_version = lines.version();
+                status_message = "\"" + path + "\" reloaded";
+                return;
+            }
+        } else {
+            size_t index = find(file_history.begin(), file_history.end(), path) - file_history.begin();
+            if (index >= buffers.size() || !buffers[index].loaded) return;  // 没有打开过，切换过去时才从磁盘加载
+            BufferState& buffer = buffers[index];
+            if (autoread && buffer.lines.version() == buffer.saved_version) {
+                buffer.undo_tree.checkpoint(buffer.lines);
+                buffer.lines = read_lines(path);
+                buffer.undo_tree.commit(buffer.lines);
+                buffer.saved_version = buffer.lines.version();
+                return;
+            }
+        }
+        status_message = "W11: Warning: File \"" + path + "\" has changed since editing started";
+    }
+
+    // 把一份行快照写入文件，progress记录已写出的行数
+    static bool write_lines(const LineBuffer& snapshot, const string& target, atomic<size_t>* progress) {
+        ofstream file(target);
+        if (!file.is_open()) return false;
+        size_t count = 0;
+        for (const string& line : snapshot) {
+            file << line << '\n';
+            if ((++count & 4095) == 0 && progress) progress->store(count, memory_order_relaxed);
+        }
+        file.close();
+        if (progress) progress->store(count, memory_order_relaxed);
+        return !file.fail();
+    }
+
+    // 保存当前文件：对缓冲区取O(1)快照，由后台线程写出，编辑可以继续。
+    // 开启undofile时，文件写出后由同一线程把撤销历史（撤销栈的快照）写入撤销文件
+    void saveFile() {
+        finish_save();  // 同一时间只进行一次保存
+        LineBuffer snapshot = lines;
+        save_target = filename;
+        save_version = snapshot.version();
+        save_total = snapshot.size();
+        save_progress = 0;
+        save_started = chrono::steady_clock::now();
+        save_undo_path = undofile && !headless ? undo_file_path(filename) : "";
+        save_undo_ok = true;
+        undo_tree.commit(lines);
+        stack<LineBuffer> history = save_undo_path.empty() ? stack<LineBuffer>() : undo_tree.history();
+        bool append_old = !undo_file_read;
+        save_state = SAVE_RUNNING;
+        save_thread = thread([this, snapshot, history, append_old]() {
+            bool ok = write_lines(snapshot, save_target, &save_progress);
+            if (ok && !save_undo_path.empty()) save_undo_ok = UndoFile::save(save_undo_path, snapshot, history, append_old);
+            save_elapsed_ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - save_started).count();
+            save_state = ok ? SAVE_DONE : SAVE_FAILED;
+            events.post([this]() { poll_save(); });  // 由主线程收取结果
+        });
+    }
+
+    // 检查后台保存是否结束，结束则回收线程并给出结果
+    void poll_save() {
+        int state = save_state;
+        if (state != SAVE_DONE && state != SAVE_FAILED) return;
+        if (save_thread.joinable()) save_thread.join();
+        save_state = SAVE_IDLE;
+        if (state == SAVE_DONE) {
+            disk_stamps[save_target] = file_stamp(save_target);  // 自己写出引起的文件变化不再提示
+            if (save_target == filename) {
+                saved_version = save_version;
+            } else {
+                for (size_t i = 0; i < buffers.size() && i < file_history.size(); ++i) {
+                    if (file_history[i] == save_target && buffers[i].loaded) buffers[i].saved_version = save_version;
+                }
+            }
+            status_message = "\"" + save_target + "\" " + to_string(save_total) + "L written (" + to_string(save_elapsed_ms) + " ms)";
+            if (!save_undo_ok) status_message = "E828: Cannot open undo file for writing: " + save_undo_path;
+        } else {
+            status_message = "E212: Can't open file for writing: " + save_target;
+        }
+    }
+
+    // 阻塞等待进行中的保存结束
+    void finish_save() {
+        if (save_thread.joinable()) save_thread.join();
+        poll_save();
+    }
+
+    // 开启自动保存时，缓冲区有未保存修改且到达间隔即在后台保存
+    void check_autosave() {
+        if (autosave_interval <= 0 || save_state != SAVE_IDLE) return;
+        auto now = chrono::steady_clock::now();
+        if (now - last_autosave < chrono::seconds(autosave_interval)) return;
+        last_autosave = now;
+        if (lines.version() != saved_version) saveFile();
+    }
+
+    // 退出前等待保存写完；脚本模式下只结束当前文件的脚本
+    void quit() {
+        finish_save();
+        if (!headless) write_session(session_path);  // 下次可以用 -S 恢复
+        finish_jobs();
+        stop_server();
+        if (headless) {
+            quit_requested = true;
+            return;
+        }
+        endwin();
+        exit(0);
+    }
+
+    // 调整窗口滚动位置以适应光标
+    void adjust_window() { 
+        // 垂直滚动
+        int height = active_view->height;
+        if (cursor_y < top_line) {
+            top_line = cursor_y;
+        } else if (cursor_y >= top_line + height) {
+            top_line = cursor_y - (height - 1);
+        }
+
+        // 水平滚动，差异模式下只有左栏的宽度
+        int width = diff_side() >= 0 ? (active_view->width - 1) / 2 : active_view->width;
+        if (cursor_x < left_column) {
+            left_column = cursor_x;
+        } else if (cursor_x >= left_column + width - 10) {
+            left_column = cursor_x - (width - 11);
+        }
+    }
+
+    // 绘制界面：每个窗口只重画变化了的行，状态栏和命令行每次重画
+    void draw() {
+        if (finder_active) {
+            draw_finder();
+            return;
+        }
+        int line_number_width = 5;  // 行号宽度
+
+        // 确保光标位置在有效范围内
+        if (cursor_y >= lines.size()) cursor_y = lines.size() - 1;
+        cursor_x = min(cursor_x, (int)lines[cursor_y].length());
+        cursor_x = max(cursor_x, 0);
+
+        if (screen_stale) {
+            erase();
+            for (auto& view : views) view->painted_top = -1, view->painted_cursor = -1, view->painted_status.clear();
+            draw_separators(layout_root.get());
+            screen_stale = false;
+        }
+        int cursor_row = 0;
+        for (auto& view : views) {
+            bool active = view.get() == active_view;
+            if (active) {
+                view->file = current_file_index;
+                view->cursor_x = cursor_x, view->cursor_y = cursor_y;
+                view->top_line = top_line, view->left_column = left_column;
+            }
+            if (active && diff_side() >= 0) {
+                sync_diff();
+                cursor_row = draw_diff(*view);
+                view->painted_top = -1;  // 差异模式每次整个重画
+            } else {
+                paint_view(*view, active);
+            }
+            if (active && diff_side() < 0) cursor_row = view->row + cursor_y - top_line;
+            if (views.size() > 1) paint_status(*view, active);
+        }
+        int cursor_col = active_view->col + cursor_x - left_column + line_number_width + 3;
+
+        // 移动光标到正确位置
+        move(cursor_row, cursor_col);
+
+        // 高亮光标位置
+        attron(A_STANDOUT);
+        if (cursor_x >= lines[cursor_y].length()) {
+            mvprintw(cursor_row, cursor_col, " ");
+        } else {
+            mvprintw(cursor_row, cursor_col, "%c", lines[cursor_y][cursor_x]);
+        }
+        attroff(A_STANDOUT);
+
+        // 绘制状态栏和命令显示
+        string message = status_message;
+        if (save_state == SAVE_RUNNING) {
+            size_t percent = save_total ? save_progress * 100 / save_total : 100;
+            message = "\"" + save_target + "\" writing " + to_string(percent) + "%";
+        }
+        attron(A_REVERSE);
+        static const char* const visual_names[] = {"NORMAL", "VISUAL", "VISUAL LINE", "VISUAL BLOCK"};
+        mvprintw(screen_height - 2, 0, " MODE: %s | FILE: %s%s %s", 
+            insert_mode_active ? "INSERT" : (command_mode_active ? "COMMAND" : visual_names[visual_mode]),
+            filename.c_str(), lines.version() != saved_version ? " [+]" : "", message.c_str());
+        clrtoeol();
+        if (recording_register) {
+            mvprintw(screen_height - 2, max(0, screen_width - 14), "recording @%c", recording_register);
+        }
+        mvprintw(screen_height - 1, 0, ": %s", command_buffer.c_str());
+        clrtoeol();
+        if (has_pending_keys()) {  // 显示未完成的计数和按键序列
+            string pending = pending_count > 0 ? to_string(pending_count) : "";
+            for (int key : pending_keys) pending += (key < 128 && isprint(key)) ? (char)key : '?';
+            mvprintw(screen_height - 1, max(0, screen_width - 12), "%s", pending.c_str());
+        }
+        attroff(A_REVERSE);
+
+        refresh();  // 刷新屏幕
+    }
+
+    // 绘制一个窗口：与上次绘制时的快照比较，只重画显示了被修改的行的屏幕行（行数变化时其后的行全部下移，
+    // 一并重画）；滚动位置改变或有可视模式选区时整个重画。活动窗口还要重画光标新旧所在的行
+    void paint_view(View& view, bool active) {
+        const LineBuffer& text = view.file == current_file_index ? lines : buffers[view.file].lines;
+        int top = view.top_line, left = view.left_column;
+        bool visual = active && visual_mode != VISUAL_NONE;
+        bool full = view.painted_top != top || view.painted_left != left || view.painted_file != view.file || visual || view.painted_visual;
+        vector<char> dirty(view.height, full);
+        if (!full && text.version() != view.painted.version()) {
+            size_t head, tail;
+            view.painted.common_affixes(text, head, tail);
+            size_t end = text.size() == view.painted.size() ? text.size() - tail : SIZE_MAX;
+            for (int row = 0; row < view.height; ++row) {
+                size_t line = top + row;
+                if (line >= head && line < end) dirty[row] = 1;
+            }
+        }
+        if (view.painted_cursor >= 0 && view.painted_cursor < view.height) dirty[view.painted_cursor] = 1;
+        int cursor_row = active ? view.cursor_y - top : -1;
+        if (cursor_row >= 0 && cursor_row < view.height) dirty[cursor_row] = 1;
+
+        int line_number_width = 5, text_width = view.width - line_number_width - 3;
+        for (int row = 0; row < view.height; ++row) {
+            if (!dirty[row]) continue;
+            size_t i = top + row;
+            string cell;
+            if (i < text.size()) {
+                stringstream ss;
+                ss << setw(line_number_width) << right << (i + 1) << " | ";  // 行号
+                cell = ss.str();
+                if (left < (int)text[i].size() && text_width > 0) cell += text[i].substr(left, text_width);  // 可见文本
+            }
+            cell.resize(view.width, ' ');
+            mvaddnstr(view.row + row, view.col, cell.c_str(), view.width);
+
+            // 高亮可视模式的选区
+            size_t begin, end;
+            if (visual && visual_columns(i, begin, end)) {
+                end = min(end, max(text[i].size(), begin + 1));  // 空行也显示一格
+                int from = max((int)begin - left, 0), to = min((int)end - left, text_width);
+                if (to > from) mvchgat(view.row + row, view.col + from + line_number_width + 3, to - from, A_REVERSE, 0, NULL);
+            }
+        }
+        view.painted = text;
+        view.painted_file = view.file;
+        view.painted_top = top;
+        view.painted_left = left;
+        view.painted_cursor = cursor_row;
+        view.painted_visual = visual;
+    }
+
+    // 有多个窗口时每个窗口下面的状态行：文件名和修改标记，活动窗口加粗
+    void paint_status(View& view, bool active) {
+        const string& name = file_history[view.file];
+        unsigned long version = view.file == current_file_index ? lines.version() : buffers[view.file].lines.version();
+        unsigned long saved = view.file == current_file_index ? saved_version : buffers[view.file].saved_version;
+        string status = " " + name + (version != saved ? " [+]" : "");
+        status.resize(view.width, ' ');
+        if (status + (active ? "*" : "") == view.painted_status) return;
+        view.painted_status = status + (active ? "*" : "");
+        attr_t attr = active ? (A_REVERSE | A_BOLD) : A_REVERSE;
+        attron(attr);
+        mvaddnstr(view.row + view.height, view.col, status.c_str(), view.width);
+        attroff(attr);
+    }
+
+    // 左右并排的窗口之间的竖线
+    void draw_separators(Frame* frame) {
+        for (size_t k = 0; k < frame->children.size(); ++k) {
+            Frame* child = frame->children[k].get();
+            draw_separators(child);
+            if (frame->vertical && k + 1 < frame->children.size()) mvvline(child->row, child->col + child->width, '|', child->height);
+        }
+    }
+
+    // 按屏幕尺寸重新计算布局：窗口区为状态栏以上的部分，子节点平分父节点的空间
+    void relayout() {
+        place_frame(layout_root.get(), 0, 0, max(1, screen_height - 2), screen_width);
+        screen_stale = true;
+        if (active_view) adjust_window();
+    }
+
+    void place_frame(Frame* frame, int row, int col, int height, int width) {
+        frame->row = row;
+        frame->col = col;
+        frame->height = height;
+        frame->width = width;
+        if (frame->view) {
+            View& view = *frame->view;
+            view.row = row;
+            view.col = col;
+            view.width = max(1, width);
+            view.height = max(1, views.size() > 1 ? height - 1 : height);  // 多个窗口时留出状态行
+            return;
+        }
+        int n = frame->children.size();
+        int space = frame->vertical ? width - (n - 1) : height;  // 左右并排时每两个窗口之间有一列竖线
+        for (int k = 0, offset = 0; k < n; ++k) {
+            int size = space / n + (k < space % n ? 1 : 0);
+            if (frame->vertical) {
+                place_frame(frame->children[k].get(), row, col + offset, height, size);
+                offset += size + 1;
+            } else {
+                place_frame(frame->children[k].get(), row + offset, col, size, width);
+                offset += size;
+            }
+        }
+    }
+
+    // 把活动窗口的光标和滚动位置存回窗口
+    void save_view() {
+        active_view->file = current_file_index;
+        active_view->cursor_x = cursor_x;
+        active_view->cursor_y = cursor_y;
+        active_view->top_line = top_line;
+        active_view->left_column = left_column;
+    }
+
+    // 切换到另一个窗口：必要时切换当前缓冲区，再恢复该窗口的光标和滚动位置
+    void enter_view(View* view) {
+        if (active_view && view != active_view) save_view();
+        active_view = view;
+        if (view->file != current_file_index) switch_to_file(view->file);
+        cursor_x = view->cursor_x;
+        cursor_y = min(view->cursor_y, (int)lines.size() - 1);
+        top_line = view->top_line;
+        left_column = view->left_column;
+        adjust_window();
+    }
+
+    // :split [文件] / :vsplit [文件]：把活动窗口上下（或左右）分成两个，新窗口在上面（左边）并成为活动窗口，
+    // 开始时与原窗口显示同一个缓冲区的同一位置
+    void split_view(bool vertical, const string& file) {
+        Frame* leaf = active_view->frame;
+        int room = vertical ? leaf->width : leaf->height;
+        if (room < (vertical ? 2 * 10 + 1 : (views.size() > 1 ? 4 : 5))) {
+            status_message = "E36: Not enough room";
+            command_failed = true;
+            return;
+        }
+        save_view();
+        auto view = make_unique<View>();
+        view->file = active_view->file;
+        view->cursor_x = cursor_x;
+        view->cursor_y = cursor_y;
+        view->top_line = top_line;
+        view->left_column = left_column;
+        auto fresh = make_unique<Frame>();
+        fresh->view = view.get();
+        view->frame = fresh.get();
+        Frame* parent = leaf->parent;
+        if (parent && parent->vertical == vertical) {
+            fresh->parent = parent;
+            auto it = find_if(parent->children.begin(), parent->children.end(), [leaf](const unique_ptr<Frame>& f) { return f.get() == leaf; });
+            parent->children.insert(it, std::move(fresh));
+        } else {
+            // 叶子变成分割节点，新窗口和原来的窗口成为它的两个子节点
+            auto old = make_unique<Frame>();
+            old->view = leaf->view;
+            old->view->frame = old.get();
+            old->parent = fresh->parent = leaf;
+            leaf->view = nullptr;
+            leaf->vertical = vertical;
+            leaf->children.push_back(std::move(fresh));
+            leaf->children.push_back(std::move(old));
+        }
+        views.push_back(std::move(view));
+        active_view = views.back().get();
+        relayout();
+        if (!file.empty()) open_file(file);
+    }
+
+    // :close：关闭活动窗口（缓冲区保留），空间交给相邻的窗口，光标进入相邻的窗口
+    void close_view() {
+        if (views.size() == 1) {
+            status_message = "E444: Cannot close last window";
+            command_failed = true;
+            return;
+        }
+        Frame* leaf = active_view->frame;
+        Frame* parent = leaf->parent;
+        auto& siblings = parent->children;
+        size_t k = find_if(siblings.begin(), siblings.end(), [leaf](const unique_ptr<Frame>& f) { return f.get() == leaf; }) - siblings.begin();
+        View* next = first_view(siblings[k > 0 ? k - 1 : k + 1].get());
+        View* closed = active_view;
+        siblings.erase(siblings.begin() + k);
+        if (siblings.size() == 1) collapse_frame(parent);
+        views.erase(find_if(views.begin(), views.end(), [closed](const unique_ptr<View>& v) { return v.get() == closed; }));
+        active_view = nullptr;
+        relayout();
+        enter_view(next);
+    }
+
+    // 只剩一个子节点的分割节点由这个子节点取代；子节点的方向与上一层相同时再并入上一层
+    void collapse_frame(Frame* frame) {
+        unique_ptr<Frame> only = std::move(frame->children[0]);
+        frame->view = only->view;
+        frame->vertical = only->vertical;
+        frame->children = std::move(only->children);
+        if (frame->view) frame->view->frame = frame;
+        for (auto& child : frame->children) child->parent = frame;
+        Frame* parent = frame->parent;
+        if (frame->view || !parent || parent->vertical != frame->vertical) return;
+        auto pos = find_if(parent->children.begin(), parent->children.end(), [frame](const unique_ptr<Frame>& f) { return f.get() == frame; });
+        vector<unique_ptr<Frame>> moved = std::move(frame->children);
+        for (auto& child : moved) child->parent = parent;
+        pos = parent->children.erase(pos);
+        parent->children.insert(pos, make_move_iterator(moved.begin()), make_move_iterator(moved.end()));
+    }
+
+    // :only：关闭活动窗口以外的所有窗口
+    void only_view() {
+        save_view();
+        View* keep = active_view;
+        views.erase(remove_if(views.begin(), views.end(), [keep](const unique_ptr<View>& v) { return v.get() != keep; }), views.end());
+        layout_root = make_unique<Frame>();
+        layout_root->view = keep;
+        keep->frame = layout_root.get();
+        relayout();
+    }
+
+    static View* first_view(Frame* frame) {
+        while (!frame->view) frame = frame->children.front().get();
+        return frame->view;
+    }
+
+    // 按布局顺序（从左上到右下）列出所有窗口
+    void collect_views(Frame* frame, vector<View*>& out) {
+        if (frame->view) {
+            out.push_back(frame->view);
+            return;
+        }
+        for (auto& child : frame->children) collect_views(child.get(), out);
+    }
+
+    // Ctrl+W w：切换到下一个窗口，带计数时切换到第count个窗口
+    void next_window(int count) {
+        vector<View*> order;
+        collect_views(layout_root.get(), order);
+        size_t k = find(order.begin(), order.end(), active_view) - order.begin();
+        enter_view(count > 0 ? order[min<size_t>(count, order.size()) - 1] : order[(k + 1) % order.size()]);
+    }
+
+    // Ctrl+W h/j/k/l：切换到左边、下面、上面、右边与光标位置相邻的窗口
+    void window_left(int) { window_towards(0, -1); }
+    void window_down(int) { window_towards(1, 0); }
+    void window_up(int) { window_towards(-1, 0); }
+    void window_right(int) { window_towards(0, 1); }
+
+    void window_towards(int dy, int dx) {
+        Frame* frame = active_view->frame;
+        int y = active_view->row + cursor_y - top_line, x = active_view->col + 8 + cursor_x - left_column;
+        if (dy < 0) y = frame->row - 1;
+        if (dy > 0) y = frame->row + frame->height;
+        if (dx < 0) x = frame->col - 2;  // 跳过竖线
+        if (dx > 0) x = frame->col + frame->width + 1;
+        x = max(0, min(x, screen_width - 1));
+        for (const auto& view : views) {
+            Frame* f = view->frame;
+            if (y >= f->row && y < f->row + f->height && x >= f->col && x < f->col + f->width + 1) {
+                enter_view(view.get());
+                return;
+            }
+        }
+    }
+
+    void split_window(int) { split_view(false, ""); }
+    void vsplit_window(int) { split_view(true, ""); }
+    void close_window(int) { close_view(); }
+    void only_window(int) { only_view(); }
+
+    // :[range]s/旧字符串/新字符串/[flags]：在范围内的每一行替换，g替换行内全部匹配，
+    // e表示没有匹配时不报错。分隔符可以是任意非字母数字字符
+    void handle_search_replace(int first, int last, const string& arg) {
+        if (arg.empty() || isalnum((unsigned char)arg[0]) || isspace((unsigned char)arg[0])) {
+            status_message = "E488: Trailing characters: " + arg;
+            command_failed = true;
+            return;
+        }
+        char delim = arg[0];
+        size_t second = arg.find(delim, 1);
+        size_t third = (second != string::npos) ? arg.find(delim, second + 1) : string::npos;
+        string old_text = arg.substr(1, second - 1);
+        string new_text = (second == string::npos) ? "" : arg.substr(second + 1, third - second - 1);
+        string flags = (third != string::npos) ? arg.substr(third + 1) : "";
+        bool global = flags.find('g') != string::npos;
+
+        int changed_lines = 0, last_changed = -1;
+        for (int y = first - 1; y < last && !old_text.empty(); ++y) {
+            size_t pos = lines[y].find(old_text);
+            if (pos == string::npos) continue;
+            if (changed_lines++ == 0) push_undo();  // 第一次替换前保存整个文本的状态
+            string& current_line = lines.mut(y);
+            while ((pos = current_line.find(old_text, pos)) != string::npos) {
+                current_line.replace(pos, old_text.length(), new_text);
+                ++substitute_count;
+                if (!global) break;
+                pos += new_text.length();
+            }
+            last_changed = y;
+        }
+
+        // 没有匹配时报错，脚本据此返回非零退出码
+        if (changed_lines == 0) {
+            if (flags.find('e') == string::npos) {
+                status_message = "E486: Pattern not found: " + old_text;
+                command_failed = true;
+            }
+            return;
+        }
+        if (changed_lines > 2) status_message = to_string(changed_lines) + " lines changed";
+
+        // 光标移到最后替换的一行
+        cursor_y = last_changed;
+        cursor_x = max(0, min(cursor_x, (int)lines[cursor_y].length() - 1));
+        adjust_window();
+    }
+
+    // 解析一个行地址（行号从1开始）：数字、.、$、'<、'>，可以跟若干 +N / -N 偏移，
+    // 只有偏移时相对于当前行。没有地址返回false；pos移到地址之后，出错时设置command_failed
+    bool parse_address(const string& cmd, size_t& pos, int& line) {
+        if (pos < cmd.size() && isdigit((unsigned char)cmd[pos])) {
+            line = 0;
+            while (pos < cmd.size() && isdigit((unsigned char)cmd[pos])) {
+                line = min(line * 10 + (cmd[pos++] - '0'), 1 << 30);
+            }
+        } else if (pos < cmd.size() && cmd[pos] == '.') {
+            line = cursor_y + 1;
+            ++pos;
+        } else if (pos < cmd.size() && cmd[pos] == '$') {
+            line = lines.size();
+            ++pos;
+        } else if (cmd.compare(pos, 2, "'<") == 0 || cmd.compare(pos, 2, "'>") == 0) {
+            int mark = cmd[pos + 1] == '<' ? visual_mark_first : visual_mark_last;
+            if (mark < 0) {
+                status_message = "E20: Mark not set";
+                command_failed = true;
+            }
+            line = mark + 1;
+            pos += 2;
+        } else if (pos < cmd.size() && (cmd[pos] == '+' || cmd[pos] == '-')) {
+            line = cursor_y + 1;
+        } else {
+            return false;
+        }
+        while (pos < cmd.size() && (cmd[pos] == '+' || cmd[pos] == '-')) {
+            int sign = cmd[pos++] == '+' ? 1 : -1;
+            int offset = 0;
+            if (pos < cmd.size() && isdigit((unsigned char)cmd[pos])) {
+                while (pos < cmd.size() && isdigit((unsigned char)cmd[pos])) {
+                    offset = min(offset * 10 + (cmd[pos++] - '0'), 1 << 30);
+                }
+            } else {
+                offset = 1;
+            }
+            line += sign * offset;
+        }
+        return true;
+    }
+
+    // 解析命令开头的行范围：%、单个地址或 a,b（a;b 相同）。没有地址时范围为当前行
+    bool parse_range(const string& cmd, size_t& pos, ExRange& range) {
+        range.first = range.last = cursor_y + 1;
+        range.count = 0;
+        if (pos < cmd.size() && cmd[pos] == '%') {
+            ++pos;
+            range.first = 1;
+            range.last = lines.size();
+            range.count = 2;
+            return true;
+        }
+        int line;
+        if (parse_address(cmd, pos, line)) {
+            range.first = range.last = line;
+            range.count = 1;
+        }
+        while (!command_failed && pos < cmd.size() && (cmd[pos] == ',' || cmd[pos] == ';')) {
+            ++pos;
+            if (!parse_address(cmd, pos, line)) line = cursor_y + 1;
+            range.first = range.last;
+            range.last = line;
+            range.count = 2;
+        }
+        return !command_failed;
+    }
+
+    // 检查范围是否在缓冲区内：行0按第1行处理，反向的范围自动交换
+    bool check_range(ExRange& range) {
+        if (range.first > range.last) swap(range.first, range.last);
+        if (range.first < 0 || range.last > (int)lines.size()) {
+            status_message = "E16: Invalid range";
+            command_failed = true;
+            return false;
+        }
+        range.first = max(range.first, 1);
+        range.last = max(range.last, 1);
+        return true;
+    }
+
+    // 解析 :d 和 :y 的参数 [x] [count]：寄存器名，以及从范围末行起的行数
+    bool parse_register_count(const string& arg, ExRange& range, char& reg) {
+        size_t pos = arg.find_first_not_of(' ');
+        if (pos != string::npos && !isdigit((unsigned char)arg[pos])) {
+            reg = arg[pos++];
+            pos = arg.find_first_not_of(' ', pos);
+        }
+        if (pos != string::npos && isdigit((unsigned char)arg[pos])) {
+            int count = 0;
+            while (pos < arg.size() && isdigit((unsigned char)arg[pos])) {
+                count = min(count * 10 + (arg[pos++] - '0'), 1 << 30);
+            }
+            if (count == 0) {
+                status_message = "E939: Positive count required";
+                command_failed = true;
+                return false;
+            }
+            range.first = range.last;
+            range.last = min((long)range.last + count - 1, (long)lines.size());
+            pos = arg.find_first_not_of(' ', pos);
+        }
+        if (pos != string::npos) {
+            status_message = "E488: Trailing characters: " + arg.substr(pos);
+            command_failed = true;
+            return false;
+        }
+        if (!isalpha((unsigned char)reg) && reg != '"') {
+            status_message = "E354: Invalid register name: " + string(1, reg);
+            command_failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    // :[range]d [x] [count]：删除范围内的行存入寄存器，一次范围删除
+    void ex_delete(ExRange range, const string& arg) {
+        char reg = '"';
+        if (!parse_register_count(arg, range, reg)) return;
+        int first = range.first - 1, last = range.last;
+        push_undo();
+        store_register(reg, lines.slice(first, last), REG_LINE);
+        lines.erase(first, last);
+        mark_adjust(first, last - first, 0);
+        if (lines.empty()) lines.push_back("");
+        cursor_y = min(first, (int)lines.size() - 1);
+        cursor_x = 0;
+        adjust_window();
+        if (last - first > 2) status_message = to_string(last - first) + " fewer lines";
+    }
+
+    // :[range]y [x] [count]：复制范围内的行到寄存器
+    void ex_yank(ExRange range, const string& arg) {
+        char reg = '"';
+        if (!parse_register_count(arg, range, reg)) return;
+        store_register(reg, lines.slice(range.first - 1, range.last), REG_LINE);
+        if (range.last - range.first + 1 > 2) status_message = to_string(range.last - range.first + 1) + " lines yanked";
+    }
+
+    // :[range]m {address} 把范围内的行移到目标行之后；:[range]t {address} 复制到目标行之后。
+    // 目标行为0表示移到或复制到文件开头
+    void ex_move_copy(ExRange range, const string& arg, bool copy) {
+        size_t pos = arg.find_first_not_of(' ');
+        int dest;
+        if (pos == string::npos || !parse_address(arg, pos, dest)) {
+            if (!command_failed) status_message = "E14: Invalid address";
+            command_failed = true;
+            return;
+        }
+        if (dest < 0 || dest > (int)lines.size()) {
+            status_message = "E16: Invalid range";
+            command_failed = true;
+            return;
+        }
+        if (!copy && dest >= range.first && dest < range.last) {
+            status_message = "E134: Cannot move a range of lines into itself";
+            command_failed = true;
+            return;
+        }
+        int first = range.first - 1, last = range.last, count = last - first;
+        LineBuffer block = lines.slice(first, last);
+        push_undo();
+        if (copy) {
+            lines.splice(dest, block);
+            mark_adjust(dest, 0, count);
+            cursor_y = dest + count - 1;
+        } else if (dest >= last) {  // 向后移动：先插入再删除，前面的行号不受影响
+            lines.splice(dest, block);
+            mark_adjust(dest, 0, count);
+            lines.erase(first, last);
+            mark_adjust(first, count, 0);
+            cursor_y = dest - 1;
+        } else {
+            lines.erase(first, last);
+            mark_adjust(first, count, 0);
+            lines.splice(dest, block);
+            mark_adjust(dest, 0, count);
+            cursor_y = dest + count - 1;
+        }
+        cursor_x = 0;
+        adjust_window();
+        if (count > 2) status_message = to_string(count) + (copy ? " more lines" : " lines moved");
+    }
+
+    // :sort / :uniq 比较行用的键：n时为行中第一个十进制数映射成的有序整数（没有数为0），
+    // 否则为行的前8个字节（大端，i时先转小写），键相同时再比较整行
+    struct SortEntry {
+        uint64_t key;
+        const string* line;
+    };
+
+    static SortEntry sort_entry(const string& line, bool numeric, bool ignore_case) {
+        uint64_t key = 0;
+        if (numeric) {
+            size_t pos = 0;
+            while (pos < line.size() && !isdigit((unsigned char)line[pos])) ++pos;
+            if (pos < line.size()) {
+                if (pos > 0 && line[pos - 1] == '-') --pos;
+                long long value = strtoll(line.c_str() + pos, nullptr, 10);  // 溢出时取最大或最小值
+                key = ((uint64_t)min(value, LLONG_MAX - 1) ^ (1ull << 63)) + 1;
+            }
+        } else {
+            for (size_t i = 0; i < 8; ++i) {
+                unsigned char c = i < line.size() ? line[i] : 0;
+                key = key << 8 | (ignore_case ? tolower(c) : c);
+            }
+        }
+        return {key, &line};
+    }
+
+    static int compare_lines(const SortEntry& a, const SortEntry& b, bool numeric, bool ignore_case) {
+        if (a.key != b.key) return a.key < b.key ? -1 : 1;
+        if (numeric) return 0;
+        const string& x = *a.line;
+        const string& y = *b.line;
+        if (!ignore_case) return x.compare(y) < 0 ? -1 : (x == y ? 0 : 1);
+        for (size_t i = 8; i < x.size() && i < y.size(); ++i) {
+            int cx = tolower((unsigned char)x[i]), cy = tolower((unsigned char)y[i]);
+            if (cx != cy) return cx < cy ? -1 : 1;
+        }
+        return x.size() == y.size() ? 0 : (x.size() < y.size() ? -1 : 1);
+    }
+
+    // 按键对entries[lo, hi)做稳定的低位优先基数排序（descending时从大到小），tmp为同样大小的临时空间；
+    // 所有元素都相同的字节不用分配
+    static void radix_sort(vector<SortEntry>& entries, vector<SortEntry>& tmp, size_t lo, size_t hi, bool descending) {
+        size_t n = hi - lo;
+        if (n < 2) return;
+        auto digit = [descending](const SortEntry& entry, int b) { return ((descending ? ~entry.key : entry.key) >> (8 * b)) & 255; };
+        vector<size_t> counts(8 * 256, 0);
+        for (size_t i = lo; i < hi; ++i) {
+            for (int b = 0; b < 8; ++b) ++counts[b * 256 + digit(entries[i], b)];
+        }
+        SortEntry* src = &entries[lo];
+        SortEntry* dst = &tmp[lo];
+        for (int b = 0; b < 8; ++b) {
+            size_t* count = &counts[b * 256];
+            if (count[digit(src[0], b)] == n) continue;
+            size_t pos[256];
+            for (size_t c = 0, sum = 0; c < 256; ++c) {
+                pos[c] = sum;
+                sum += count[c];
+            }
+            for (size_t i = 0; i < n; ++i) dst[pos[digit(src[i], b)]++] = src[i];
+            swap(src, dst);
+        }
+        if (src != &entries[lo]) copy(src, src + n, &entries[lo]);
+    }
+
+    // 解析 :sort / :uniq 的参数：开头的!和allowed中的标志字母
+    bool parse_sort_flags(const string& arg, const string& allowed, bool& bang, string& flags) {
+        bang = !arg.empty() && arg[0] == '!';
+        for (size_t i = bang ? 1 : 0; i < arg.size(); ++i) {
+            if (arg[i] == ' ') continue;
+            if (allowed.find(arg[i]) == string::npos) {
+                status_message = "E474: Invalid argument";
+                command_failed = true;
+                return false;
+            }
+            flags += arg[i];
+        }
+        return true;
+    }
+
+    // :[range]sort[!] [n][u][r][i]：对范围内（默认整个文件）的行稳定排序。n按行中第一个十进制数（可带负号）排序，
+    // 没有数的行排在最前；u相同的行只保留第一行；!或r倒序；i忽略大小写。
+    // 只排序键和指向行的指针，不移动行内容：各段在线程池中并行做基数排序后两两并行归并，
+    // 最后按顺序复制出新的行一次替换回缓冲区，一次撤销
+    void ex_sort(ExRange range, const string& arg) {
+        bool bang;
+        string flags;
+        if (!parse_sort_flags(arg, "nuri", bang, flags)) return;
+        bool numeric = flags.find('n') != string::npos, unique_only = flags.find('u') != string::npos;
+        bool reverse = bang || flags.find('r') != string::npos, ignore_case = flags.find('i') != string::npos;
+        int first = range.first - 1, last = range.last;
+        size_t count = last - first;
+        if (count < 2) return;
+
+        size_t parts = min<size_t>(thread::hardware_concurrency(), count / 65536 + 1);
+        vector<SortEntry> entries(count), merged(count);
+        vector<size_t> bounds(parts + 1);
+        for (size_t p = 0; p <= parts; ++p) bounds[p] = count * p / parts;
+        auto less = [&](const SortEntry& a, const SortEntry& b) {
+            int result = compare_lines(a, b, numeric, ignore_case);
+            return reverse ? result > 0 : result < 0;
+        };
+        {
+            ThreadPool pool(parts);
+            for (size_t p = 0; p < parts; ++p) {
+                pool.submit([&, p]() {
+                    auto it = lines.at(first + bounds[p]);
+                    for (size_t i = bounds[p]; i < bounds[p + 1]; ++i, ++it) entries[i] = sort_entry(*it, numeric, ignore_case);
+                    radix_sort(entries, merged, bounds[p], bounds[p + 1], reverse);
+                    // 键相同的行再按整行排序
+                    for (size_t i = bounds[p], j; !numeric && i < bounds[p + 1]; i = j) {
+                        for (j = i + 1; j < bounds[p + 1] && entries[j].key == entries[i].key; ++j) {}
+                        if (j - i > 1) stable_sort(entries.begin() + i, entries.begin() + j, less);
+                    }
+                });
+            }
+            pool.wait();
+            // 相邻的已排序段两两归并，每轮段数减半
+            for (size_t width = 1; width < parts; width *= 2) {
+                for (size_t p = 0; p < parts; p += 2 * width) {
+                    pool.submit([&, p, width]() {
+                        size_t lo = bounds[p], mid = bounds[min(p + width, parts)], hi = bounds[min(p + 2 * width, parts)];
+                        merge(entries.begin() + lo, entries.begin() + mid, entries.begin() + mid, entries.begin() + hi, merged.begin() + lo, less);
+                    });
+                }
+                pool.wait();
+                entries.swap(merged);
+            }
+            if (unique_only) {
+                // 按整行（i时忽略大小写）去重。不带n时比较结果相同就是整行相同；带n时只比较数，
+                // 键相同的一组行里重复的行不一定相邻，用集合在组内去重，保留第一次出现的行
+                size_t kept = 0;
+                for (size_t i = 0, j; i < entries.size(); i = j) {
+                    for (j = i + 1; j < entries.size() && compare_lines(entries[i], entries[j], numeric, ignore_case) == 0; ++j) {}
+                    if (!numeric || j - i == 1) {
+                        entries[kept++] = entries[i];
+                        continue;
+                    }
+                    unordered_set<string> seen;
+                    for (size_t k = i; k < j; ++k) {
+                        string line = *entries[k].line;
+                        if (ignore_case) transform(line.begin(), line.end(), line.begin(), [](unsigned char c) { return tolower(c); });
+                        if (seen.insert(std::move(line)).second) entries[kept++] = entries[k];
+                    }
+                }
+                entries.resize(kept);
+            }
+
+            merged.clear();
+            vector<string> sorted(entries.size());
+            size_t block = 65536;
+            for (size_t from = 0; from < sorted.size(); from += block) {
+                pool.submit([&, from]() {
+                    size_t end = min(sorted.size(), from + block);
+                    for (size_t i = from; i < end; ++i) {
+                        // 行按排序后的顺序随机访问，提前预取后面的string对象和行内容
+                        if (i + 16 < end) __builtin_prefetch(entries[i + 16].line);
+                        if (i + 8 < end) __builtin_prefetch(entries[i + 8].line->data());
+                        sorted[i] = *entries[i].line;
+                    }
+                });
+            }
+            pool.wait();
+            push_undo();
+            lines.replace(first, last, std::move(sorted));
+        }
+        size_t removed = count - entries.size();
+        mark_adjust(first, count, entries.size());
+        cursor_y = first;
+        cursor_x = 0;
+        adjust_window();
+        if (removed > 2) status_message = to_string(removed) + " fewer lines";
+    }
+
+    // :[range]uniq[!] [i][u]：去掉范围内（默认整个文件）相邻的重复行，只保留第一行。
+    // !只保留有重复的行（每组一行），u只保留没有重复的行，i忽略大小写
+    void ex_uniq(ExRange range, const string& arg) {
+        bool bang;
+        string flags;
+        if (!parse_sort_flags(arg, "iu", bang, flags)) return;
+        bool ignore_case = flags.find('i') != string::npos, unique_only = flags.find('u') != string::npos;
+        int first = range.first - 1, last = range.last;
+        size_t count = last - first;
+        vector<char> drop(lines.size(), 0);
+        size_t removed = 0;
+        auto it = lines.at(first);
+        SortEntry group = sort_entry(*it, false, ignore_case);
+        size_t group_start = first, group_size = 1;
+        auto close_group = [&]() {
+            bool keep = bang ? group_size > 1 : (unique_only ? group_size == 1 : true);
+            for (size_t y = group_start + (keep ? 1 : 0); y < group_start + group_size; ++y) drop[y] = 1;
+            removed += group_size - (keep ? 1 : 0);
+        };
+        for (size_t y = first + 1; y < (size_t)last; ++y) {
+            SortEntry entry = sort_entry(*++it, false, ignore_case);
+            if (compare_lines(group, entry, false, ignore_case) == 0) {
+                ++group_size;
+                continue;
+            }
+            close_group();
+            group = entry;
+            group_start = y;
+            group_size = 1;
+        }
+        close_group();
+        if (removed == 0) return;
+        push_undo();
+        lines.erase_marked(drop);
+        if (lines.empty()) lines.push_back("");
+        mark_adjust(first, count, count - removed);
+        cursor_y = min(first, (int)lines.size() - 1);
+        cursor_x = 0;
+        adjust_window();
+        if (removed > 2) status_message = to_string(removed) + " fewer lines";
+    }
+
+    static bool is_delete_command(const string& name) {
+        return name == "d" || name == "de" || name == "del" || name == "delete";
+    }
+
+    // :[range]g/pat/cmd：对包含pat的每一行执行cmd，:v 和 :g! 对不包含pat的行执行。
+    // 先扫描一遍标记所有匹配行，再逐个执行；cmd增删行时由mark_adjust修正剩余标记的行号。
+    // cmd为 d [x] 时不逐行执行，而是一次线性压缩删除全部匹配行
+    void global_command(ExRange range, string arg, bool invert) {
+        if (global_active) {
+            status_message = "E147: Cannot do :global recursive";
+            command_failed = true;
+            return;
+        }
+        if (!arg.empty() && arg[0] == '!') {
+            invert = !invert;
+            arg.erase(0, 1);
+        }
+        if (arg.empty() || isalnum((unsigned char)arg[0]) || isspace((unsigned char)arg[0]) || arg[0] == '"') {
+            status_message = "E146: Regular expressions can't be delimited by letters";
+            command_failed = true;
+            return;
+        }
+        size_t end = arg.find(arg[0], 1);
+        string pattern = arg.substr(1, end - 1);
+        string cmd = (end == string::npos) ? "" : arg.substr(end + 1);
+        if (pattern.empty()) {
+            status_message = "E35: No previous regular expression";
+            command_failed = true;
+            return;
+        }
+
+        vector<int> matches;
+        int y = 0;
+        for (const string& line : lines) {
+            if (y >= range.last) break;
+            if (y >= range.first - 1 && (line.find(pattern) != string::npos) != invert) matches.push_back(y);
+            ++y;
+        }
+        if (matches.empty()) {
+            status_message = "Pattern not found: " + pattern;
+            return;
+        }
+
+        // cmd为 d [x]：一次压缩删除
+        size_t name_begin = cmd.find_first_not_of(' ');
+        size_t name_end = (name_begin == string::npos) ? 0 : name_begin;
+        while (name_end < cmd.size() && isalpha((unsigned char)cmd[name_end])) ++name_end;
+        if (name_begin != string::npos && is_delete_command(cmd.substr(name_begin, name_end - name_begin))) {
+            string reg_arg = cmd.substr(name_end);
+            size_t reg_pos = reg_arg.find_first_not_of(' ');
+            if (reg_pos == string::npos || reg_arg.find_first_not_of(' ', reg_pos + 1) == string::npos) {
+                char reg = (reg_pos == string::npos) ? '"' : reg_arg[reg_pos];
+                if (isdigit((unsigned char)reg) == 0) {
+                    global_delete(matches, reg);
+                    return;
+                }
+            }
+        }
+
+        global_active = true;
+        global_marks = std::move(matches);
+        global_deleted.assign(global_marks.size(), 0);
+        global_next = 0;
+        global_offset = 0;
+        if (replay_frames.empty()) undo_group_saved = false;  // 整个:g作为一步撤销
+        bool any_succeeded = false;
+        string error;
+        while (global_next < global_marks.size()) {
+            size_t j = global_next++;
+            if (global_deleted[j]) continue;
+            cursor_y = global_marks[j] + global_offset;
+            cursor_x = 0;
+            command_failed = false;
+            execute_command(cmd);
+            if (command_failed) {
+                error = status_message;
+            } else {
+                any_succeeded = true;
+            }
+            if (quit_requested) break;
+        }
+        global_active = false;
+        // 只要有一行执行成功就不算出错（例如 :g/a/s/b/c/ 中没有b的行）
+        command_failed = !any_succeeded;
+        if (!any_succeeded) status_message = error;
+        else if (status_message.size() > 1 && status_message[0] == 'E' && isdigit((unsigned char)status_message[1])) status_message.clear();
+        adjust_window();
+    }
+
+    // :g/pat/d：按标记一次线性压缩缓冲区。与vim相同，小写寄存器只保留最后删除的一行，
+    // 大写寄存器追加全部删除的行
+    void global_delete(const vector<int>& matches, char reg) {
+        if (!isalpha((unsigned char)reg) && reg != '"') {
+            status_message = "E354: Invalid register name: " + string(1, reg);
+            command_failed = true;
+            return;
+        }
+        push_undo();
+        if (isupper((unsigned char)reg)) {
+            LineBuffer deleted;
+            for (int y : matches) deleted.push_back(lines[y]);
+            store_register(reg, deleted, REG_LINE);
+        } else {
+            store_register(reg, lines.slice(matches.back(), matches.back() + 1), REG_LINE);
+        }
+        vector<char> drop(lines.size(), 0);
+        for (int y : matches) drop[y] = 1;
+        lines.erase_marked(drop);
+        if (lines.empty()) lines.push_back("");
+        cursor_y = min(matches.back() - (int)matches.size() + 1, (int)lines.size() - 1);
+        cursor_x = 0;
+        adjust_window();
+        if (matches.size() > 2) status_message = to_string(matches.size()) + " fewer lines";
+    }
+
+    // :g执行期间命令在pos行删除removed行、插入inserted行后，修正尚未处理的标记（vim的mark_adjust）。
+    // 被删除的标记收拢到pos并置为已删除，标记始终有序；受影响的是全部剩余标记时只调整公共偏移
+    void mark_adjust(int pos, int removed, int inserted) {
+        if (!global_active) return;
+        auto remaining = global_marks.begin() + global_next;
+        size_t j = lower_bound(remaining, global_marks.end(), pos - global_offset) - global_marks.begin();
+        bool all = (j == global_next);
+        for (; j < global_marks.size() && global_marks[j] + global_offset < pos + removed; ++j) {
+            global_deleted[j] = 1;
+            global_marks[j] = pos - global_offset;
+        }
+        int delta = inserted - removed;
+        if (all) {
+            global_offset += delta;
+        } else {
+            for (; j < global_marks.size(); ++j) global_marks[j] += delta;
+        }
+    }
+
+    // 切换到文件列表中的第index个文件：保存当前文件的状态，恢复目标文件的状态（第一次打开时从磁盘加载）
+    void switch_to_file(size_t index) {
+        stash_buffer();
+        restore_buffer(index);
+        if (active_view) active_view->file = index;
+    }
+
+    // 把当前文件的状态移入buffers
+    void stash_buffer() {
+        update_keywords();
+        undo_tree.commit(lines);
+        buffers.resize(file_history.size());
+        BufferState& buffer = buffers[current_file_index];
+        buffer.loaded = true;
+        buffer.lines = std::move(lines);
+        buffer.undo_tree = std::move(undo_tree);
+        buffer.saved_version = saved_version;
+        buffer.undo_file_read = undo_file_read;
+        buffer.cursor_x = cursor_x;
+        buffer.cursor_y = cursor_y;
+        buffer.top_line = top_line;
+        buffer.left_column = left_column;
+        buffer.indexed = std::move(indexed_lines);
+        indexed_lines = LineBuffer();  // 接下来的文件还没有内容在索引中
+    }
+
+    // 把第index个文件设为当前文件并恢复其状态
+    void restore_buffer(size_t index) {
+        buffers.resize(file_history.size());
+        current_file_index = index;
+        BufferState& buffer = buffers[index];
+        if (!buffer.loaded && buffer.session_record >= 0 && session) {
+            restore_session_buffer(buffer.session_record);
+            return;
+        }
+        if (!buffer.loaded) {
+            loadFile();
+            cursor_x = cursor_y = top_line = left_column = 0;
+            return;
+        }
+        filename = file_history[index];
+        lines = std::move(buffer.lines);
+        undo_tree = std::move(buffer.undo_tree);
+        saved_version = buffer.saved_version;
+        undo_file_read = buffer.undo_file_read;
+        cursor_x = buffer.cursor_x;
+        cursor_y = buffer.cursor_y;
+        top_line = buffer.top_line;
+        left_column = buffer.left_column;
+        indexed_lines = std::move(buffer.indexed);
+        buffer = BufferState();
+        adjust_window();
+    }
+
+    // 文件当前的内容：当前文件为lines，已打开过的文件为保存的状态，否则返回false
+    bool buffer_lines(const string& name, LineBuffer& out) const {
+        if (name == filename) {
+            out = lines;
+            return true;
+        }
+        for (size_t i = 0; i < buffers.size() && i < file_history.size(); ++i) {
+            if (file_history[i] == name && buffers[i].loaded) {
+                out = buffers[i].lines;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // :diffthis：把当前缓冲区加入比较，凑齐两个缓冲区后并排显示它们的差异
+    void diff_this() {
+        if (find(diff_files.begin(), diff_files.end(), current_file_index) == diff_files.end()) {
+            if (diff_files.size() == 2) {
+                status_message = "E96: Cannot diff more than 2 buffers";
+                command_failed = true;
+                return;
+            }
+            diff_files.push_back(current_file_index);
+        }
+        if (diff_files.size() == 2) diff_update();
+    }
+
+    // :diffupdate：重新完整比较两个缓冲区
+    void diff_update() {
+        if (diff_files.size() < 2) {
+            status_message = "E99: Current buffer is not in diff mode";
+            command_failed = true;
+            return;
+        }
+        auto started = chrono::steady_clock::now();
+        const LineBuffer& a = diff_files[0] == current_file_index ? lines : buffers[diff_files[0]].lines;
+        const LineBuffer& b = diff_files[1] == current_file_index ? lines : buffers[diff_files[1]].lines;
+        diff.compute(a, b);
+        long elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+        status_message = to_string(diff.hunks().size()) + " changes (" + to_string(elapsed) + " ms)";
+    }
+
+    // :diffoff：退出差异模式
+    void diff_off() {
+        diff_files.clear();
+        diff = LineDiff();
+    }
+
+    // 当前缓冲区在比较中的一侧，不在比较中或另一侧还没有加入时返回-1
+    int diff_side() const {
+        if (diff_files.size() < 2) return -1;
+        if (diff_files[0] == current_file_index) return 0;
+        return diff_files[1] == current_file_index ? 1 : -1;
+    }
+
+    // 把两侧在上次比较之后的修改同步到比较结果，只重算受影响的区块
+    void sync_diff() {
+        for (int side = 0; side < 2; ++side) {
+            const LineBuffer& now = diff_files[side] == current_file_index ? lines : buffers[diff_files[side]].lines;
+            if (now.version() != diff.lines(side).version()) diff.update(side, now);
+        }
+    }
+
+    // 从当前缓冲区的第top行起，逐个屏幕行列出左栏（当前缓冲区）和右栏对应的行号，-1表示填充行
+    template <class Visit>
+    void diff_rows(size_t top, int rows, Visit visit) {
+        int side = diff_side(), other = 1 - side;
+        const vector<LineDiff::Hunk>& hunks = diff.hunks();
+        // 第一个不在top之前结束的区块；正好在top处、这一侧没有行的区块也要显示
+        size_t h = lower_bound(hunks.begin(), hunks.end(), top, [side](const LineDiff::Hunk& hunk, size_t line) {
+            return hunk.end(side) < line || (hunk.end(side) == line && hunk.count[side] > 0);
+        }) - hunks.begin();
+        size_t a = top, b, skip = 0;
+        if (h < hunks.size() && hunks[h].start[side] <= top) {
+            skip = top - hunks[h].start[side];
+            b = hunks[h].start[other] + skip;
+        } else {
+            b = h == 0 ? top : top + hunks[h - 1].end(other) - hunks[h - 1].end(side);
+        }
+        size_t size = diff.lines(side).size();
+        int row = 0;
+        while (row < rows) {
+            size_t same_end = h < hunks.size() ? hunks[h].start[side] : size;
+            for (; a < same_end && row < rows; ++a, ++b) visit(row++, (long)a, (long)b, false);
+            if (h == hunks.size() || row == rows) break;
+            const LineDiff::Hunk& hunk = hunks[h];
+            for (size_t k = skip; k < max(hunk.count[side], hunk.count[other]) && row < rows; ++k) {
+                long left = k < hunk.count[side] ? (long)(hunk.start[side] + k) : -1;
+                long right = k < hunk.count[other] ? (long)(hunk.start[other] + k) : -1;
+                visit(row++, left, right, true);
+            }
+            a = hunk.end(side);
+            b = hunk.end(other);
+            skip = 0;
+            ++h;
+        }
+    }
+
+    // 差异模式的界面：当前缓冲区在窗口的左栏、另一个缓冲区在右栏，两栏一起滚动，相同的行对齐，
+    // 改动区块中对方缺少的行用"-"填充。返回光标所在的屏幕行
+    int draw_diff(View& view) {
+        int side = diff_side(), rows = view.height;
+        int pane = (view.width - 1) / 2, line_number_width = 5;
+        // 光标之前的填充行把光标挤出屏幕时向下滚动
+        int cursor_row = -1;
+        while (true) {
+            diff_rows(top_line, rows, [&](int row, long left, long, bool) { if (left == cursor_y) cursor_row = row; });
+            if (cursor_row >= 0 || top_line >= cursor_y) break;
+            ++top_line;
+        }
+        auto highlight = [](int pair, attr_t fallback) { return has_colors() ? COLOR_PAIR(pair) : fallback; };
+        auto draw_cell = [&](int row, int x, int width, const LineBuffer& text, long line, bool changed, bool paired) {
+            string cell;
+            attr_t attr = A_NORMAL;
+            if (line < 0) {
+                cell.assign(width, '-');
+                attr = highlight(3, A_DIM);
+            } else {
+                stringstream ss;
+                ss << setw(line_number_width) << right << (line + 1) << " | ";
+                cell = ss.str();
+                if (left_column < (int)text[line].size()) cell += text[line].substr(left_column, width - cell.size());
+                cell.resize(width, ' ');
+                if (changed) attr = paired ? highlight(1, A_REVERSE) : highlight(2, A_REVERSE);
+            }
+            attron(attr);
+            mvaddnstr(view.row + row, view.col + x, cell.c_str(), width);
+            attroff(attr);
+        };
+        int used = 0;
+        diff_rows(top_line, rows, [&](int row, long left, long right, bool changed) {
+            draw_cell(row, 0, pane, lines, left, changed, left >= 0 && right >= 0);
+            mvaddch(view.row + row, view.col + pane, '|');
+            draw_cell(row, pane + 1, view.width - pane - 1, diff.lines(1 - side), right, changed, left >= 0 && right >= 0);
+            used = row + 1;
+            // 高亮可视模式的选区
+            size_t begin, end;
+            if (left >= 0 && visual_mode != VISUAL_NONE && visual_columns(left, begin, end)) {
+                end = min(end, max(lines[left].size(), begin + 1));
+                int from = max((int)begin - left_column, 0), to = min((int)end - left_column, pane - line_number_width - 3);
+                if (to > from) mvchgat(view.row + row, view.col + from + line_number_width + 3, to - from, A_REVERSE, 0, NULL);
+            }
+        });
+        for (int row = used; row < rows; ++row) mvhline(view.row + row, view.col, ' ', view.width);
+        return view.row + cursor_row;
+    }
+
+    // ]c / [c：跳到后面/前面第count个改动区块的开头
+    void next_change(int count) { jump_to_change(max(count, 1)); }
+    void previous_change(int count) { jump_to_change(-max(count, 1)); }
+
+    void jump_to_change(int steps) {
+        int side = diff_side();
+        if (side < 0) {
+            status_message = "E99: Current buffer is not in diff mode";
+            command_failed = true;
+            return;
+        }
+        sync_diff();
+        const vector<LineDiff::Hunk>& hunks = diff.hunks();
+        auto before = [side](const LineDiff::Hunk& hunk, size_t line) { return hunk.start[side] < line; };
+        size_t line = cursor_y;
+        for (int i = 0; i < abs(steps); ++i) {
+            size_t h = lower_bound(hunks.begin(), hunks.end(), steps > 0 ? line + 1 : line, before) - hunks.begin();
+            if (steps > 0 ? h == hunks.size() : h == 0) break;
+            line = hunks[steps > 0 ? h : h - 1].start[side];
+        }
+        if (line == (size_t)cursor_y) {
+            status_message = "No more changes";
+            command_failed = true;
+            return;
+        }
+        cursor_y = min(line, lines.size() - 1);
+        cursor_x = 0;
+        adjust_window();
+    }
+
+    // :bufdo {cmd} / :argdo {cmd}：对前count个缓冲区逐个执行命令。
+    // 只作用于单个缓冲区的命令（:s、:g、:v、:w，可带行范围）在线程池中并行执行：每个缓冲区的状态
+    // 交给一个独立的无界面实例，带着自己的撤销历史执行完再交回，寄存器等共享状态不受影响；
+    // 其他命令依次切换到各缓冲区执行。结束后回到原来的缓冲区，并给出每个文件的结果和总耗时
+    void buffer_do(const string& cmd, size_t count) {
+        size_t begin = cmd.find_first_not_of(' ');
+        if (begin == string::npos) {
+            status_message = "E471: Argument required";
+            command_failed = true;
+            return;
+        }
+        string command = cmd.substr(begin);
+        size_t name_begin = command.find_first_not_of("0123456789.,;$%'<>+- ");
+        size_t name_end = name_begin;
+        while (name_end < command.size() && isalpha((unsigned char)command[name_end])) ++name_end;
+        string name = (name_begin == string::npos) ? "" : command.substr(name_begin, name_end - name_begin);
+        static const vector<string> independent = {"s", "su", "substitute", "g", "global", "v", "vglobal", "w"};
+        bool parallel = find(independent.begin(), independent.end(), name) != independent.end();
+
+        struct Result {
+            bool failed = false, modified = false;
+            size_t substitutions = 0;
+            string message;
+        };
+        vector<Result> results(count);
+        auto started = chrono::steady_clock::now();
+        size_t original = current_file_index;
+        if (parallel) {
+            stash_buffer();
+            ThreadPool pool(min<size_t>(count, thread::hardware_concurrency()));
+            for (size_t i = 0; i < count; ++i) {
+                pool.submit([&, i]() {
+                    MiniVim worker({}, true);
+                    worker.file_history = {file_history[i]};
+                    worker.buffers.push_back(std::move(buffers[i]));
+                    worker.restore_buffer(0);
+                    unsigned long version = worker.lines.version();
+                    worker.execute_command(command);
+                    worker.finish_save();
+                    results[i] = {worker.command_failed, worker.lines.version() != version, worker.substitute_count, worker.status_message};
+                    worker.stash_buffer();
+                    buffers[i] = std::move(worker.buffers[0]);
+                });
+            }
+            pool.wait();
+            restore_buffer(original);
+        } else {
+            for (size_t i = 0; i < count && !quit_requested; ++i) {
+                switch_to_file(i);
+                unsigned long version = lines.version();
+                size_t substitutions = substitute_count;
+                command_failed = false;
+                execute_command(command);
+                results[i] = {command_failed, lines.version() != version, substitute_count - substitutions, status_message};
+            }
+            if (current_file_index != original) switch_to_file(original);
+        }
+        long elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+
+        // 汇总
+        size_t modified = 0, failed = 0, substitutions = 0;
+        bufdo_summary.clear();
+        for (size_t i = 0; i < count; ++i) {
+            const Result& result = results[i];
+            modified += result.modified;
+            failed += result.failed;
+            substitutions += result.substitutions;
+            string line = file_history[i] + ": ";
+            if (result.failed) line += result.message;
+            else if (result.substitutions) line += to_string(result.substitutions) + " substitutions";
+            else line += result.modified ? "modified" : "unchanged";
+            bufdo_summary.push_back(line);
+        }
+        command_failed = failed > 0;
+        status_message = to_string(count) + " buffers, " + to_string(modified) + " modified";
+        if (substitutions) status_message += ", " + to_string(substitutions) + " substitutions";
+        if (failed) status_message += ", " + to_string(failed) + " failed";
+        status_message += " (" + to_string(elapsed) + " ms" + (parallel ? ", parallel" : "") + ")";
+        if (!headless && count > 1) show_list("bufdo");
+    }
+
+    // 在一段文本中查找pattern，每个匹配行（all为true时每个匹配）记一项quickfix。
+    // 直接在整段文本上查找，行号只在找到匹配后用memchr数换行符得到
+    static void grep_text(const char* data, size_t size, const string& pattern, bool all,
+                          const string& name, int first_line, vector<QuickfixEntry>& out) {
+        const char* end = data + size;
+        const char* line_start = data;
+        int line = first_line;
+        const char* p = data;
+        while (const char* match = find_literal(p, end, pattern)) {
+            while (const char* newline = (const char*)memchr(line_start, '\n', match - line_start)) {
+                ++line;
+                line_start = newline + 1;
+            }
+            const char* eol = (const char*)memchr(match, '\n', end - match);
+            if (!eol) eol = end;
+            out.push_back({name, line, (int)(match - line_start), string(line_start, eol)});
+            p = all ? match + pattern.size() : eol;
+        }
+    }
+
+    // :vimgrep /pat/[g][j] [文件...]：在给出的文件（可以使用通配符）中查找，没有给出文件时查找所有缓冲区。
+    // 每个文件一个任务，在工作窃取线程池中并行搜索；已打开的文件搜索内存中的内容（包括未保存的修改），
+    // 其他文件直接整块读入后搜索。结果按文件顺序组成quickfix列表，并跳到第一项（j标志表示不跳转）
+    void vimgrep(const string& arg) {
+        size_t pos = arg.find_first_not_of(' ');
+        if (pos == string::npos) {
+            status_message = "E683: File name missing or invalid pattern";
+            command_failed = true;
+            return;
+        }
+        string pattern, flags;
+        if (isalnum((unsigned char)arg[pos])) {  // 不带分隔符时模式为第一个单词
+            size_t end = arg.find(' ', pos);
+            pattern = arg.substr(pos, end - pos);
+            pos = end;
+        } else {
+            size_t end = arg.find(arg[pos], pos + 1);
+            if (end == string::npos) {
+                status_message = "E683: File name missing or invalid pattern";
+                command_failed = true;
+                return;
+            }
+            pattern = arg.substr(pos + 1, end - pos - 1);
+            for (pos = end + 1; pos < arg.size() && isalpha((unsigned char)arg[pos]); ++pos) flags += arg[pos];
+        }
+        if (pattern.empty()) {
+            status_message = "E35: No previous regular expression";
+            command_failed = true;
+            return;
+        }
+
+        // 要搜索的文件：展开通配符；没有给出时为所有缓冲区
+        vector<string> files;
+        istringstream names(pos < arg.size() ? arg.substr(pos) : "");
+        string name;
+        while (names >> name) {
+            glob_t matches;
+            if (glob(name.c_str(), 0, nullptr, &matches) == 0) {
+                for (size_t i = 0; i < matches.gl_pathc; ++i) files.push_back(matches.gl_pathv[i]);
+            }
+            globfree(&matches);
+        }
+        if (files.empty()) {
+            if (pos < arg.size() && arg.find_first_not_of(' ', pos) != string::npos) {
+                status_message = "E480: No match: " + arg.substr(arg.find_first_not_of(' ', pos));
+                command_failed = true;
+                return;
+            }
+            for (const string& file : file_history) {
+                if (find(files.begin(), files.end(), file) == files.end()) files.push_back(file);
+            }
+        }
+
+        auto started = chrono::steady_clock::now();
+        bool all = flags.find('g') != string::npos;
+        vector<vector<QuickfixEntry>> results(files.size());
+        {
+            vector<LineBuffer> snapshots(files.size());  // 已打开文件内容的快照，须比线程池活得久
+            vector<char> in_memory(files.size());
+            for (size_t i = 0; i < files.size(); ++i) in_memory[i] = buffer_lines(files[i], snapshots[i]);
+            ThreadPool pool(min<size_t>(files.size(), thread::hardware_concurrency()));
+            for (size_t i = 0; i < files.size(); ++i) {
+                pool.submit([&, i]() {
+                    if (in_memory[i]) {
+                        int y = 0;
+                        for (const string& line : snapshots[i]) {
+                            grep_text(line.data(), line.size(), pattern, all, files[i], y++, results[i]);
+                        }
+                        return;
+                    }
+                    ifstream file(files[i], ios::binary);
+                    if (!file.is_open()) return;
+                    file.seekg(0, ios::end);
+                    string data(max<streamoff>(file.tellg(), 0), '\0');
+                    file.seekg(0);
+                    file.read(&data[0], data.size());
+                    data.resize(file.gcount());
+                    grep_text(data.data(), data.size(), pattern, all, files[i], 0, results[i]);
+                });
+            }
+        }
+        long elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+
+        quickfix.clear();
+        for (auto& entries : results) {
+            quickfix.insert(quickfix.end(), make_move_iterator(entries.begin()), make_move_iterator(entries.end()));
+        }
+        quickfix_index = 0;
+        if (quickfix.empty()) {
+            status_message = "E480: No match: " + pattern;
+            command_failed = true;
+            return;
+        }
+        if (flags.find('j') == string::npos) quickfix_jump(0);
+        status_message = "(" + to_string(quickfix_index + 1) + " of " + to_string(quickfix.size()) + ") in " +
+                         to_string(files.size()) + " files, " + to_string(elapsed) + " ms: " + quickfix[quickfix_index].text;
+    }
+
+    // 跳到quickfix列表的第index项：需要时切换文件，再定位到匹配的行和列
+    void quickfix_jump(size_t index) {
+        if (quickfix.empty()) {
+            status_message = "E42: No Errors";
+            command_failed = true;
+            return;
+        }
+        if (index >= quickfix.size()) {
+            status_message = "E553: No more items";
+            command_failed = true;
+            return;
+        }
+        quickfix_index = index;
+        const QuickfixEntry& entry = quickfix[index];
+        open_file(entry.filename);
+        cursor_y = min(entry.line, (int)lines.size() - 1);
+        cursor_x = min(entry.column, max(0, (int)lines[cursor_y].size() - 1));
+        adjust_window();
+        status_message = "(" + to_string(index + 1) + " of " + to_string(quickfix.size()) + "): " + entry.text;
+    }
+
+    // Ctrl+]：跳到光标下单词的定义
+    void tag_under_cursor(int) {
+        const string& line = lines[cursor_y];
+        int begin = min(cursor_x, (int)line.size()), end = begin;
+        while (begin > 0 && KeywordIndex::is_word_char(line[begin - 1])) --begin;
+        while (end < (int)line.size() && KeywordIndex::is_word_char(line[end])) ++end;
+        if (begin == end) {
+            status_message = "E349: No identifier under cursor";
+            command_failed = true;
+            return;
+        }
+        jump_to_tag(line.substr(begin, end - begin));
+    }
+
+    // :tag name：在标签文件中二分查找name，记下当前位置后跳到第一个定义
+    void jump_to_tag(const string& name) {
+        if (!tag_file.open(tags_path)) {
+            status_message = "E433: No tags file";
+            command_failed = true;
+            return;
+        }
+        vector<TagFile::Tag> found = tag_file.find(name);
+        if (found.empty()) {
+            status_message = "E426: tag not found: " + name;
+            command_failed = true;
+            return;
+        }
+        tag_stack.push_back({filename, cursor_x, cursor_y});
+        tag_matches = std::move(found);
+        select_tag_match(0);
+    }
+
+    // 跳到上一次 :tag 找到的第index个位置（:tn / :tp）
+    void select_tag_match(size_t index) {
+        if (tag_matches.empty()) {
+            status_message = "E73: tag stack empty";
+            command_failed = true;
+            return;
+        }
+        if (index >= tag_matches.size()) {
+            status_message = index == (size_t)-1 ? "E425: Cannot go before first matching tag" : "E428: Cannot go beyond last matching tag";
+            command_failed = true;
+            return;
+        }
+        tag_match_index = index;
+        const TagFile::Tag& tag = tag_matches[index];
+        // 标签中的相对路径相对于标签文件所在的目录
+        string path = tag.file;
+        size_t slash = tag_file.file_path().rfind('/');
+        if (!path.empty() && path[0] != '/' && slash != string::npos) path = normalize_path(tag_file.file_path().substr(0, slash + 1) + path);
+        open_file(path);
+
+        // 行号，或 /^...$/ 形式的查找模式（按原样匹配整行或行的一部分）
+        int target = 0;
+        const string& address = tag.address;
+        if (is_number(address)) {
+            target = stoi(address) - 1;
+        } else if (address.size() >= 2 && (address[0] == '/' || address[0] == '?')) {
+            string pattern = address.substr(1, address.size() - 2);
+            bool anchored_start = !pattern.empty() && pattern[0] == '^';
+            bool anchored_end = pattern.size() > 1 && pattern.back() == '$' && pattern[pattern.size() - 2] != '\\';
+            if (anchored_start) pattern.erase(0, 1);
+            if (anchored_end) pattern.pop_back();
+            string text;
+            for (size_t i = 0; i < pattern.size(); ++i) {
+                if (pattern[i] == '\\' && i + 1 < pattern.size()) ++i;
+                text += pattern[i];
+            }
+            int y = 0;
+            for (const string& line : lines) {
+                bool match = (anchored_start && anchored_end) ? line == text
+                           : anchored_start ? line.compare(0, text.size(), text) == 0
+                           : line.find(text) != string::npos;
+                if (match) {
+                    target = y;
+                    break;
+                }
+                ++y;
+            }
+        }
+        cursor_y = max(0, min(target, (int)lines.size() - 1));
+        cursor_x = 0;
+        adjust_window();
+        status_message = "tag " + to_string(index + 1) + " of " + to_string(tag_matches.size()) + ": " + tag.name;
+    }
+
+    // Ctrl+T / :pop：回到上一次跳转前的位置
+    void pop_tag(int) {
+        if (tag_stack.empty()) {
+            status_message = "E73: tag stack empty";
+            command_failed = true;
+            return;
+        }
+        TagStackEntry entry = tag_stack.back();
+        tag_stack.pop_back();
+        open_file(entry.file);
+        cursor_y = min(entry.y, (int)lines.size() - 1);
+        cursor_x = entry.x;
+        adjust_window();
+    }
+
+    // 切换到文件：已在文件列表中则切换过去，否则加入列表后打开
+    void open_file(const string& name) {
+        if (name == filename) return;
+        size_t index = find(file_history.begin(), file_history.end(), name) - file_history.begin();
+        if (index == file_history.size()) file_history.push_back(name);
+        switch_to_file(index);
+    }
+
+    // 第index个缓冲区的内容：当前文件为lines，其他文件为保存的状态（没有打开过的文件视为空缓冲区）
+    LineBuffer& buffer_text(size_t index) {
+        if (index == current_file_index) return lines;
+        buffers.resize(file_history.size());
+        BufferState& buffer = buffers[index];
+        if (!buffer.loaded) {
+            buffer.loaded = true;
+            buffer.lines.push_back("");
+            buffer.saved_version = buffer.lines.version();
+        }
+        return buffer.lines;
+    }
+
+    // 命令输出用的缓冲区，名字为 "!命令"：已存在则清空后复用，否则加入文件列表
+    size_t output_buffer(const string& command) {
+        string name = "!" + command;
+        size_t index = find(file_history.begin(), file_history.end(), name) - file_history.begin();
+        if (index == file_history.size()) file_history.push_back(name);
+        LineBuffer& text = buffer_text(index);
+        text.clear();
+        text.push_back("");
+        if (index == current_file_index) cursor_x = cursor_y = 0;
+        return index;
+    }
+
+    // 用 /bin/sh -c 启动命令：标准输入为in_fd（-1表示/dev/null），标准输出和标准错误都为out_fd。
+    // 子进程在自己的进程组中运行，结束命令时可以连同它派生的进程一起结束。失败时返回-1
+    static pid_t spawn_shell(const string& command, int in_fd, int out_fd) {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (in_fd < 0) {
+            posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+        } else {
+            posix_spawn_file_actions_adddup2(&actions, in_fd, 0);
+        }
+        posix_spawn_file_actions_adddup2(&actions, out_fd, 1);
+        posix_spawn_file_actions_adddup2(&actions, out_fd, 2);
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attr, 0);
+        const char* argv[] = {"/bin/sh", "-c", command.c_str(), nullptr};
+        pid_t pid;
+        int error = posix_spawn(&pid, "/bin/sh", &actions, &attr, (char* const*)argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+        return error == 0 ? pid : -1;
+    }
+
+    // 把[p, end)中的数据按行切分追加到out，最后没有换行符的部分留在partial中，与下一次读到的数据相接
+    static void split_lines(const char* p, const char* end, string& partial, vector<string>& out) {
+        while (const char* newline = (const char*)memchr(p, '\n', end - p)) {
+            partial.append(p, newline);
+            out.push_back(std::move(partial));
+            partial.clear();
+            p = newline + 1;
+        }
+        partial.append(p, end);
+    }
+
+    // 用 /bin/sh -c 在后台运行命令，输出从第file个缓冲区的第line行之前开始插入；
+    // replace_empty表示输出到命令缓冲区，第一批替换其中开始时的空行。脚本模式下等待命令结束
+    void start_job(const string& command, size_t file, size_t line, bool replace_empty) {
+        int pipe_fds[2];
+        if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+            status_message = "E482: Can't create pipe for command";
+            command_failed = true;
+            return;
+        }
+        pid_t pid = spawn_shell(command, -1, pipe_fds[1]);
+        close(pipe_fds[1]);
+        if (pid < 0) {
+            close(pipe_fds[0]);
+            status_message = "E472: Command failed: " + command;
+            command_failed = true;
+            return;
+        }
+        jobs.push_back(make_unique<Job>());
+        Job* job = jobs.back().get();
+        job->id = next_job_id++;
+        job->command = command;
+        job->pid = pid;
+        job->fd = pipe_fds[0];
+        job->file = file;
+        job->line = line;
+        job->replace_empty = job->scratch = replace_empty;
+        job->seen = buffer_text(file);
+        job->reader = thread([this, job]() { read_job_output(job); });
+        if (headless) {
+            job->reader.join();
+            events.run_posted();
+        }
+    }
+
+    // 读取线程：按行切分子进程的输出交给主线程，读到文件结束后回收子进程
+    void read_job_output(Job* job) {
+        vector<char> buffer(1 << 16);
+        string partial;  // 还没有读到换行符的行尾
+        while (true) {
+            ssize_t n = read(job->fd, buffer.data(), buffer.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            vector<string> got;
+            split_lines(buffer.data(), buffer.data() + n, partial, got);
+            deliver_job_output(job, got, -1);
+        }
+        close(job->fd);
+        vector<string> rest;
+        if (!partial.empty()) rest.push_back(std::move(partial));
+        int status = 0;
+        while (waitpid(job->pid, &status, 0) < 0 && errno == EINTR) {}
+        deliver_job_output(job, rest, status);
+    }
+
+    // 读取线程把新读到的行加入batch；主线程已经取走了上一批时才投递新的插入任务
+    void deliver_job_output(Job* job, vector<string>& got, int status) {
+        lock_guard<mutex> guard(job->lock);
+        if (job->batch.empty()) {
+            job->batch.swap(got);
+        } else {
+            job->batch.insert(job->batch.end(), make_move_iterator(got.begin()), make_move_iterator(got.end()));
+        }
+        if (status >= 0) job->status = status;
+        if (job->posted) return;
+        job->posted = true;
+        events.post([this, job]() { insert_job_output(job); });
+    }
+
+    // 下一批的插入位置：上一批之后缓冲区改过时按前后相同的部分修正，修改都在插入位置之前时随之平移，
+    // 改动跨过插入位置时接在改过的部分之后
+    static size_t job_insert_line(const Job* job, const LineBuffer& text) {
+        const LineBuffer& seen = job->seen;
+        size_t line = min(job->line, seen.size());
+        if (text.version() == seen.version()) return line;
+        size_t head, tail;
+        text.common_affixes(seen, head, tail);
+        if (line <= head) return line;
+        if (line >= seen.size() - tail) return line + text.size() - seen.size();
+        return text.size() - tail;
+    }
+
+    // 主线程：把积累的行一次插入目标缓冲区；命令结束后给出结果并回收读取线程
+    void insert_job_output(Job* job) {
+        vector<string> batch;
+        int status;
+        {
+            lock_guard<mutex> guard(job->lock);
+            batch.swap(job->batch);
+            job->posted = false;
+            status = job->status;
+        }
+        if (!batch.empty() && !job->detached) {
+            LineBuffer& text = buffer_text(job->file);
+            size_t count = batch.size();
+            if (job->replace_empty && text.size() == 1 && text[0].empty()) {
+                text.replace(0, 1, std::move(batch));
+                job->line = count;
+            } else {
+                size_t line = job_insert_line(job, text);
+                // :r !命令：其间用户的修改先记成单独的一步，连续到达的各批并入同一步，用户没有插手时整个输出只占一步撤销
+                UndoTree* history = job->scratch ? nullptr : job->file == current_file_index ? &undo_tree : &buffers[job->file].undo_tree;
+                bool merge = history && history->current_seq() == job->undo_seq && text.version() == job->seen.version();
+                if (history && !merge) history->commit(text);
+                text.insert(line, std::move(batch));
+                if (history && !(merge && history->extend(text))) {
+                    history->commit(text);
+                    job->undo_seq = history->current_seq();
+                }
+                if (job->file == current_file_index && (size_t)cursor_y >= line && !job->replace_empty) cursor_y += count;  // 插入在光标之前时光标随原来的行移动
+                job->line = line + count;
+            }
+            job->replace_empty = false;
+            job->received += count;
+            job->seen = text;
+        }
+        if (status < 0) return;
+        if (job->reader.joinable()) job->reader.join();
+        if (job->scratch) {
+            unsigned long version = buffer_text(job->file).version();
+            (job->file == current_file_index ? saved_version : buffers[job->file].saved_version) = version;
+        }
+        status_message = "!" + job->command + ": " + to_string(job->received) + "L";
+        if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+            status_message += " (shell returned " + to_string(WEXITSTATUS(status)) + ")";
+        } else if (WIFSIGNALED(status)) {
+            status_message += " (killed by signal " + to_string(WTERMSIG(status)) + ")";
+        }
+        jobs.erase(find_if(jobs.begin(), jobs.end(), [job](const unique_ptr<Job>& j) { return j.get() == job; }));
+    }
+
+    // 结束命令（id为0时结束全部）：向进程组发送SIGTERM，读取线程读到文件结束后照常收尾
+    void stop_jobs(int id) {
+        bool found = false;
+        for (auto& job : jobs) {
+            if (id != 0 && job->id != id) continue;
+            kill(-job->pid, SIGTERM);
+            found = true;
+        }
+        if (!found && id != 0) {
+            status_message = "E900: Invalid job id: " + to_string(id);
+            command_failed = true;
+        }
+    }
+
+    // 撤销树中移动之前结束向当前缓冲区插入输出的 :r !命令：插入位置在另一个状态的文本中已无意义，之后到达的输出丢弃
+    void detach_read_jobs() {
+        for (auto& job : jobs) {
+            if (job->scratch || job->file != current_file_index || job->detached) continue;
+            job->detached = true;
+            kill(-job->pid, SIGTERM);
+        }
+    }
+
+    // 退出前结束所有命令并等待读取线程退出
+    void finish_jobs() {
+        stop_jobs(0);
+        for (auto& job : jobs) {
+            if (job->reader.joinable()) job->reader.join();
+        }
+        jobs.clear();
+    }
+
+    // :r [!命令 | 文件]：在范围末行（默认当前行）之后插入命令的输出或文件的内容，:0r 插入到第一行之前。
+    // 命令的输出在后台陆续插入，各批插入时自己记下撤销（见insert_job_output），撤销会结束命令；:g 中不能用 :r !命令
+    void ex_read(const ExRange& range, const string& arg) {
+        size_t begin = arg.find_first_not_of(' ');
+        string what = begin == string::npos ? "" : arg.substr(begin);
+        int after = range.count > 0 ? range.last : cursor_y + 1;
+        if (after < 0 || after > (int)lines.size()) {
+            status_message = "E16: Invalid range";
+            command_failed = true;
+            return;
+        }
+        if (what.empty() || what == "!") {
+            status_message = what.empty() ? "E32: No file name" : "E34: No previous command";
+            command_failed = true;
+            return;
+        }
+        if (what[0] == '!') {
+            if (global_active) {  // 输出在后台到达，届时各行的标记早已处理完
+                status_message = "E523: Not allowed here: :r !" + what.substr(1);
+                command_failed = true;
+                return;
+            }
+            start_job(what.substr(1), current_file_index, after, false);
+            return;
+        }
+        if (access(what.c_str(), R_OK) != 0) {
+            status_message = "E484: Can't open file " + what;
+            command_failed = true;
+            return;
+        }
+        push_undo();
+        LineBuffer text = read_lines(what);
+        lines.splice(after, text);
+        mark_adjust(after, 0, text.size());
+        cursor_y = after;
+        cursor_x = 0;
+        adjust_window();
+    }
+
+    // 把各行写到fd，每行之后加换行符，用writev成批写出。长行的iovec直接指向快照中该行的存储，不复制；
+    // 短行逐段提交时内核处理每段的开销远大于复制本身，所以连同换行符先拷入暂存块，按整块提交。
+    // 部分写出时从断开处继续。读端提前关闭（EPIPE）时返回false
+    static bool write_lines_to(int fd, const LineBuffer& text) {
+        const size_t long_line = 4096, stage_size = 1 << 18;
+        vector<char> stage(stage_size);
+        size_t staged = 0, run_start = 0;  // 暂存块已用的字节数，尚未加入iov的一段从run_start开始
+        vector<iovec> iov;
+        iov.reserve(IOV_MAX);
+        auto close_run = [&]() {
+            if (staged > run_start) iov.push_back({stage.data() + run_start, staged - run_start});
+            run_start = staged;
+        };
+        auto flush = [&]() {
+            close_run();
+            size_t k = 0;
+            while (k < iov.size()) {
+                ssize_t n = writev(fd, iov.data() + k, iov.size() - k);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) return false;
+                while (k < iov.size() && (size_t)n >= iov[k].iov_len) n -= iov[k++].iov_len;
+                if (k < iov.size()) {
+                    iov[k].iov_base = (char*)iov[k].iov_base + n;
+                    iov[k].iov_len -= n;
+                }
+            }
+            iov.clear();
+            staged = run_start = 0;
+            return true;
+        };
+        for (const string& line : text) {
+            bool direct = line.size() >= long_line;
+            size_t need = direct ? 1 : line.size() + 1;
+            if ((staged + need > stage_size || iov.size() + 3 > IOV_MAX) && !flush()) return false;
+            if (direct) {
+                close_run();
+                iov.push_back({(void*)line.data(), line.size()});
+            } else {
+                memcpy(stage.data() + staged, line.data(), line.size());
+                staged += line.size();
+            }
+            stage[staged++] = '\n';
+        }
+        return flush();
+    }
+
+    // :a,b!命令：把范围内的行作为命令的标准输入，用命令的输出（包括标准错误）替换这些行，作为一步撤销。
+    // 写入线程从范围的快照写出，主线程同时读取输出，命令边读边写时两边的管道都不会因为写满而互相等待。
+    // 等待输出时按Ctrl+c结束命令（整个进程组），范围内的行不变
+    void ex_filter(const ExRange& range, const string& command) {
+        if (command.empty()) {
+            status_message = "E34: No previous command";
+            command_failed = true;
+            return;
+        }
+        int first = range.first - 1, last = range.last;
+        int to_child[2], from_child[2];
+        if (pipe2(to_child, O_CLOEXEC) != 0) {
+            status_message = "E482: Can't create pipe for command";
+            command_failed = true;
+            return;
+        }
+        if (pipe2(from_child, O_CLOEXEC) != 0) {
+            close(to_child[0]);
+            close(to_child[1]);
+            status_message = "E482: Can't create pipe for command";
+            command_failed = true;
+            return;
+        }
+        pid_t pid = spawn_shell(command, to_child[0], from_child[1]);
+        close(to_child[0]);
+        close(from_child[1]);
+        if (pid < 0) {
+            close(to_child[1]);
+            close(from_child[0]);
+            status_message = "E472: Command failed: " + command;
+            command_failed = true;
+            return;
+        }
+        fcntl(to_child[1], F_SETPIPE_SZ, 1 << 20);  // 加大管道，减少写入线程与命令之间的切换
+        fcntl(from_child[0], F_SETPIPE_SZ, 1 << 20);
+        LineBuffer input = lines.slice(first, last);
+        thread writer([&input, fd = to_child[1]]() {
+            sigset_t pipe_signal;  // 命令不读完输入就退出时write返回EPIPE，不让SIGPIPE结束编辑器
+            sigemptyset(&pipe_signal);
+            sigaddset(&pipe_signal, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &pipe_signal, nullptr);
+            write_lines_to(fd, input);
+            close(fd);
+        });
+        vector<string> output;
+        vector<char> buffer(1 << 20);
+        string partial;
+        bool interrupted = false;
+        pollfd fds[2] = {{from_child[0], POLLIN, 0}, {0, POLLIN, 0}};  // 同时等待终端输入，Ctrl+c结束命令
+        while (true) {
+            if (poll(fds, headless ? 1 : 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (fds[1].revents && interrupt_requested()) {
+                kill(-pid, SIGTERM);
+                interrupted = true;
+                break;
+            }
+            if (!fds[0].revents) continue;
+            ssize_t n = read(from_child[0], buffer.data(), buffer.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            split_lines(buffer.data(), buffer.data() + n, partial, output);
+        }
+        if (!partial.empty()) output.push_back(std::move(partial));
+        close(from_child[0]);
+        writer.join();
+        int status = 0;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+        if (interrupted) {  // 范围内的行保持不变
+            status_message = "Interrupted";
+            command_failed = true;
+            return;
+        }
+
+        size_t count = output.size();
+        push_undo();
+        lines.replace(first, last, std::move(output));
+        mark_adjust(first, last - first, count);
+        if (lines.empty()) lines.push_back("");
+        cursor_y = min(first, (int)lines.size() - 1);
+        cursor_x = 0;
+        adjust_window();
+        if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+            status_message = "shell returned " + to_string(WEXITSTATUS(status));
+        } else if (last - first > 2) {
+            status_message = to_string(last - first) + " lines filtered";
+        }
+    }
+
+    // :!命令：在名为 "!命令" 的缓冲区中显示命令的输出（在后台陆续插入），当前窗口切换到这个缓冲区。
+    // :job 命令：同样运行但不切换窗口；不带参数时列出运行中的命令
+    void shell_command(const string& command, bool show) {
+        if (command.empty()) {
+            status_message = "E34: No previous command";
+            command_failed = true;
+            return;
+        }
+        size_t index = output_buffer(command);
+        if (show && index != current_file_index) switch_to_file(index);
+        start_job(command, index, 0, true);
+        if (!show && !headless && !command_failed) status_message = "[" + to_string(next_job_id - 1) + "] " + command;
+    }
+
+    // 连接path上的服务器，失败时返回-1
+    static int connect_server(const string& path) {
+        sockaddr_un addr = {};
+        if (path.size() >= sizeof(addr.sun_path)) return -1;
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // 服务器套接字可读：接受所有等待中的连接（只接受同一用户的），每个连接的请求在可读时非阻塞地读取
+    void accept_clients() {
+        int fd;
+        while ((fd = accept4(server_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            ucred peer;
+            socklen_t length = sizeof(peer);
+            if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0 || peer.uid != getuid()) {
+                close(fd);  // 只接受同一用户的请求
+                continue;
+            }
+            auto request = make_shared<string>();
+            events.add_reader(fd, [this, fd, request]() { read_client(fd, *request); });
+        }
+    }
+
+    // 读取客户端的请求，读到对方关闭写方向后打开其中的文件，回复后关闭连接
+    void read_client(int fd, string& request) {
+        char buffer[4096];
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) request.append(buffer, n);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;  // 请求还没有读完
+        string message = std::move(request);
+        events.remove_reader(fd);
+        if (n == 0) {
+            open_remote(message);
+            if (write(fd, "ok\n", 3) < 0) {}  // 客户端等到回复才退出
+        }
+        close(fd);
+    }
+
+    // 文件对应的撤销文件：完整路径中的'/'换成'%'（与vim相同），放在undodir中
+    string undo_file_path(const string& file) const {
+        if (undo_dir.empty() || file.empty() || file[0] == '!') return "";
+        char cwd[PATH_MAX];
+        string full = normalize_path(file[0] == '/' ? file : string(getcwd(cwd, sizeof(cwd)) ? cwd : "") + "/" + file);
+        replace(full.begin(), full.end(), '/', '%');
+        return undo_dir + "/" + full;
+    }
+
+    // 按字面规范化路径：去掉 "." 和多余的 "/"，".." 与前一段抵消
+    static string normalize_path(const string& path) {
+        vector<string> parts;
+        stringstream stream(path);
+        string part;
+        while (getline(stream, part, '/')) {
+            if (part.empty() || part == ".") continue;
+            if (part == ".." && !parts.empty() && parts.back() != "..") {
+                parts.pop_back();
+            } else {
+                parts.push_back(part);
+            }
+        }
+        string result = path[0] == '/' ? "" : ".";
+        for (const string& p : parts) result += "/" + p;
+        if (result.empty()) return "/";
+        return result[0] == '.' ? (result.size() > 2 ? result.substr(2) : ".") : result;
+    }
+
+    // 把相对于当前目录的path改写成相对于目录dir的路径（按字面计算），绝对路径原样返回
+    static string relative_path(const string& dir, const string& path) {
+        if (path.empty() || path[0] == '/') return path;
+        char cwd[PATH_MAX];
+        string here = getcwd(cwd, sizeof(cwd)) ? cwd : "";
+        auto split = [&here](const string& name) {
+            vector<string> parts;
+            stringstream stream(normalize_path(name[0] == '/' ? name : here + "/" + name));
+            string part;
+            while (getline(stream, part, '/')) {
+                if (!part.empty()) parts.push_back(part);
+            }
+            return parts;
+        };
+        vector<string> from = split(dir), to = split(path);
+        size_t common = 0;
+        while (common < from.size() && common + 1 < to.size() && from[common] == to[common]) ++common;
+        string result;
+        for (size_t i = common; i < from.size(); ++i) result += "../";
+        for (size_t i = common; i < to.size(); ++i) result += (i > common ? "/" : "") + to[i];
+        return result;
+    }
+
+    // 打开 --remote 请求中的文件：相对路径按客户端的当前目录解析，位于编辑器当前目录下的文件换成相对路径，
+    // 与命令行上打开的文件名一致，已打开的缓冲区直接切换过去。最后一个文件显示在当前窗口
+    void open_remote(const string& message) {
+        vector<string> fields;
+        size_t start = 0;
+        for (size_t i = 0; i <= message.size(); ++i) {
+            if (i == message.size() || message[i] == '\0') {
+                fields.push_back(message.substr(start, i - start));
+                start = i + 1;
+            }
+        }
+        if (fields.size() < 2) return;
+        char cwd[PATH_MAX];
+        string here = getcwd(cwd, sizeof(cwd)) ? normalize_path(cwd) : "";
+        if (insert_mode_active || visual_mode != VISUAL_NONE || finder_active) dispatch_key(27);  // 像先按了ESC再 :e 文件
+        for (size_t i = 1; i < fields.size(); ++i) {
+            if (fields[i].empty()) continue;
+            string path = normalize_path(fields[i][0] == '/' ? fields[i] : fields[0] + "/" + fields[i]);
+            if (!here.empty() && path.size() > here.size() && path.compare(0, here.size(), here) == 0 && path[here.size()] == '/') {
+                path = path.substr(here.size() + (here == "/" ? 0 : 1));
+            }
+            open_file(path);
+        }
+        status_message = "\"" + filename + "\" " + to_string(lines.size()) + "L";
+    }
+
+    // 关闭服务器套接字并删除套接字文件
+    void stop_server() {
+        if (server_fd < 0) return;
+        events.remove_reader(server_fd);
+        close(server_fd);
+        server_fd = -1;
+        unlink(server_socket.c_str());
+    }
+
+    // :files [查询]：在当前目录树中模糊查找文件。第一次使用（或 :files!）时并行遍历目录树并缓存文件列表，
+    // 然后进入查找界面，之后的按键经dispatch_key交给finder_mode，宏和预输入的按键同样适用。
+    // 脚本模式下直接打开得分最高的文件
+    void find_file(const string& query, bool rescan) {
+        if (file_finder.empty() || rescan) {
+            if (!headless) {
+                mvprintw(screen_height - 1, 0, "Scanning files...");
+                refresh();
+            }
+            file_finder.scan(".");
+        }
+        if (headless) {
+            size_t total;
+            vector<uint32_t> best = file_finder.match(query, 1, total);
+            if (best.empty()) {
+                status_message = "E345: Can't find file \"" + query + "\" in path";
+                command_failed = true;
+                return;
+            }
+            open_file(file_finder[best[0]]);
+            return;
+        }
+        finder_active = true;
+        finder_query = query;
+        finder_selected = 0;
+        finder_rows = 0;
+    }
+
+    // 查找界面的按键：输入字符修改查询，↑/↓（Ctrl+P/Ctrl+N）选择，回车打开，ESC取消，Ctrl+U清空查询
+    void finder_mode(int ch) {
+        if (ch == 27) {
+            finder_active = false;
+        } else if (ch == 10 || ch == KEY_ENTER) {
+            const vector<uint32_t>& best = finder_matches();
+            finder_active = false;
+            if (!best.empty()) open_file(file_finder[best[finder_selected]]);
+        } else if (ch == KEY_UP || ch == 16) {
+            if (finder_selected > 0) --finder_selected;
+        } else if (ch == KEY_DOWN || ch == 14) {
+            if (finder_selected + 1 < finder_matches().size()) ++finder_selected;
+        } else if (ch == 8 || ch == 127 || ch == KEY_BACKSPACE) {
+            if (!finder_query.empty()) finder_query.pop_back();
+            finder_selected = finder_rows = 0;  // 查询变了，画出来或用到结果时再重新匹配
+        } else if (ch == 21) {  // Ctrl+U 清空查询
+            finder_query.clear();
+            finder_selected = finder_rows = 0;
+        } else if (ch >= 32 && ch < 256) {
+            finder_query += ch;
+            finder_selected = finder_rows = 0;
+        }
+    }
+
+    // 当前查询得分最高的文件，最多为屏幕除最后一行外的行数。查询或屏幕高度变化后才重新匹配，
+    // 连续输入的多个字符只匹配一次
+    const vector<uint32_t>& finder_matches() {
+        size_t rows = max(1, screen_height - 1);
+        if (finder_rows != rows) {
+            finder_best = file_finder.match(finder_query, rows, finder_total);
+            finder_rows = rows;
+        }
+        finder_selected = min(finder_selected, finder_best.empty() ? 0 : finder_best.size() - 1);
+        return finder_best;
+    }
+
+    // 画出查找界面：结果列表占满屏幕，最后一行为查询和匹配数
+    void draw_finder() {
+        const vector<uint32_t>& best = finder_matches();
+        erase();
+        screen_stale = true;  // 返回编辑界面后所有窗口需要重画
+        for (size_t i = 0; i < best.size(); ++i) {
+            if (i == finder_selected) attron(A_REVERSE);
+            mvprintw(i, 0, "%s", file_finder[best[i]].c_str());
+            if (i == finder_selected) attroff(A_REVERSE);
+        }
+        mvprintw(screen_height - 1, 0, "> %s", finder_query.c_str());
+        mvprintw(screen_height - 1, max(0, screen_width - 24), "%zu/%zu", finder_total, file_finder.size());
+        move(screen_height - 1, 2 + finder_query.size());
+        refresh();
+    }
+
+    // 扫描一个源文件中的定义，输出标签行（名称、文件、行号、类型）。
+    // C/C++文件识别宏、类型、命名空间和函数定义，配置文件识别节名和键名，都只按行做简单的判断
+    static void scan_definitions(const string& path, const string& data, vector<string>& out) {
+        size_t dot = path.rfind('.');
+        string ext = (dot == string::npos) ? "" : path.substr(dot + 1);
+        static const vector<string> c_exts = {"c", "cc", "cpp", "cxx", "h", "hh", "hpp", "hxx"};
+        static const vector<string> config_exts = {"ini", "conf", "cfg", "toml", "yaml", "yml", "properties"};
+        bool is_c = find(c_exts.begin(), c_exts.end(), ext) != c_exts.end();
+        bool is_config = find(config_exts.begin(), config_exts.end(), ext) != config_exts.end();
+        if (!is_c && !is_config) return;
+
+        auto identifier_at = [](const string& text, size_t pos) {
+            size_t end = pos;
+            while (end < text.size() && KeywordIndex::is_word_char(text[end])) ++end;
+            return text.substr(pos, end - pos);
+        };
+        auto emit = [&](const string& name, int line, char kind) {
+            if (!name.empty() && !isdigit((unsigned char)name[0])) {
+                out.push_back(name + "\t" + path + "\t" + to_string(line + 1) + ";\"\t" + kind);
+            }
+        };
+        static const vector<string> control = {"if", "for", "while", "switch", "return", "sizeof", "catch", "else", "do", "case", "new", "delete"};
+
+        vector<string> rows;
+        istringstream in(data);
+        for (string row; getline(in, row);) rows.push_back(row);
+        for (int y = 0; y < (int)rows.size(); ++y) {
+            const string& row = rows[y];
+            size_t begin = row.find_first_not_of(" \t");
+            if (begin == string::npos) continue;
+            string text = row.substr(begin);
+            while (!text.empty() && isspace((unsigned char)text.back())) text.pop_back();
+            if (is_config) {
+                if (text[0] == '#' || text[0] == ';') continue;
+                if (text[0] == '[') {
+                    emit(text.substr(1, text.find(']') - 1), y, 's');
+                } else {
+                    size_t sep = text.find_first_of("=:");
+                    if (sep == string::npos) continue;
+                    string key = text.substr(0, sep);
+                    while (!key.empty() && isspace((unsigned char)key.back())) key.pop_back();
+                    if (!key.empty() && all_of(key.begin(), key.end(), [](char c) { return KeywordIndex::is_word_char(c) || c == '-' || c == '.'; })) {
+                        emit(key, y, 'k');
+                    }
+                }
+                continue;
+            }
+            if (text[0] == '#') {  // #define NAME
+                size_t pos = text.find_first_not_of(" \t", 1);
+                if (pos != string::npos && text.compare(pos, 6, "define") == 0) {
+                    pos = text.find_first_not_of(" \t", pos + 6);
+                    if (pos != string::npos) emit(identifier_at(text, pos), y, 'd');
+                }
+                continue;
+            }
+            if (text.compare(0, 2, "//") == 0 || text[0] == '*' || text.compare(0, 2, "/*") == 0) continue;
+            string first = identifier_at(text, 0);
+            size_t pos = first.size();
+            if (first == "typedef") {
+                pos = text.find_first_not_of(" \t", pos);
+                if (pos == string::npos) continue;
+                first = identifier_at(text, pos);
+                pos += first.size();
+            }
+            if (first == "class" || first == "struct" || first == "union" || first == "enum" || first == "namespace") {
+                pos = text.find_first_not_of(" \t", pos);
+                if (first == "enum" && pos != string::npos && (text.compare(pos, 5, "class") == 0 || text.compare(pos, 6, "struct") == 0)) {
+                    pos = text.find_first_not_of(" \t", text.find_first_of(" \t", pos));
+                }
+                // 只有声明（以分号结尾且没有定义体）的不算
+                if (pos != string::npos && (text.back() != ';' || text.find('{') != string::npos)) {
+                    emit(identifier_at(text, pos), y, first == "namespace" ? 'n' : first == "enum" ? 'g' : first[0]);
+                }
+                continue;
+            }
+            // 函数定义：行以 { 结尾，或以 ) / const 结尾且下一行以 { 或初始化列表的 : 开头
+            size_t paren = text.find('(');
+            if (paren == string::npos || paren == 0) continue;
+            bool body_follows = text.back() == '{';
+            if (!body_follows && (text.back() == ')' || (text.size() > 5 && text.compare(text.size() - 5, 5, "const") == 0)) && y + 1 < (int)rows.size()) {
+                size_t next = rows[y + 1].find_first_not_of(" \t");
+                body_follows = next != string::npos && (rows[y + 1][next] == '{' || rows[y + 1][next] == ':');
+            }
+            if (!body_follows) continue;
+            size_t end = paren;
+            while (end > 0 && isspace((unsigned char)text[end - 1])) --end;
+            size_t start = end;
+            while (start > 0 && KeywordIndex::is_word_char(text[start - 1])) --start;
+            string name = text.substr(start, end - start);
+            if (start > 0 && text[start - 1] == '~') name = "~" + name;
+            if (name.empty() || find(control.begin(), control.end(), name) != control.end()) continue;
+            if (find(control.begin(), control.end(), first) != control.end() || text.find('=') < paren) continue;
+            // 排除成员函数调用（obj.f(...) {）、初始化列表和多行条件的续行（括号不配对）
+            if (first.empty() && text[0] != '~') continue;
+            if (text.find('.') < start || text.find("->") < start) continue;
+            if (count(text.begin(), text.end(), '(') != count(text.begin(), text.end(), ')')) continue;
+            emit(name, y, 'f');
+        }
+    }
+
+    // :mktags [文件...]：在线程池中并行扫描给出的文件（可用通配符，默认所有已打开的文件）中的定义，
+    // 排序后写成标签文件，之后 :tag 直接对它二分查找。文件名写成相对于标签文件所在目录的路径
+    void make_tags(const string& arg) {
+        vector<string> files;
+        istringstream names(arg);
+        string name;
+        while (names >> name) {
+            glob_t matches;
+            if (glob(name.c_str(), 0, nullptr, &matches) == 0) {
+                for (size_t i = 0; i < matches.gl_pathc; ++i) files.push_back(matches.gl_pathv[i]);
+            }
+            globfree(&matches);
+        }
+        if (files.empty()) files = file_history;
+        sort(files.begin(), files.end());
+        files.erase(unique(files.begin(), files.end()), files.end());
+
+        auto started = chrono::steady_clock::now();
+        size_t slash = tags_path.rfind('/');
+        string tags_dir = slash == string::npos ? "." : tags_path.substr(0, slash + 1);
+        vector<string> tag_names(files.size());
+        for (size_t i = 0; i < files.size(); ++i) tag_names[i] = relative_path(tags_dir, files[i]);
+        vector<vector<string>> results(files.size());
+        {
+            ThreadPool pool(min<size_t>(files.size(), thread::hardware_concurrency()));
+            for (size_t i = 0; i < files.size(); ++i) {
+                pool.submit([&, i]() {
+                    ifstream file(files[i], ios::binary);
+                    if (!file.is_open()) return;
+                    stringstream data;
+                    data << file.rdbuf();
+                    scan_definitions(tag_names[i], data.str(), results[i]);
+                });
+            }
+        }
+        vector<string> entries;
+        for (auto& tags : results) entries.insert(entries.end(), make_move_iterator(tags.begin()), make_move_iterator(tags.end()));
+        sort(entries.begin(), entries.end());  // 制表符小于名称中的任何字符，整行排序即按名称排序
+        entries.erase(unique(entries.begin(), entries.end()), entries.end());
+
+        tag_file.close();
+        ofstream out(tags_path);
+        if (!out.is_open()) {
+            status_message = "E212: Can't open file for writing: " + tags_path;
+            command_failed = true;
+            return;
+        }
+        out << "!_TAG_FILE_FORMAT\t2\t/extended format/\n";
+        out << "!_TAG_FILE_SORTED\t1\t/0=unsorted, 1=sorted, 2=foldcase/\n";
+        for (const string& entry : entries) out << entry << '\n';
+        out.close();
+        long elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+        status_message = "\"" + tags_path + "\" " + to_string(entries.size()) + " tags from " + to_string(files.size()) + " files (" + to_string(elapsed) + " ms)";
+    }
+
+    // 检查字符串是否为数字
+    bool is_number(const string& str) {
+        return !str.empty() && all_of(str.begin(), str.end(), ::isdigit);
+    }
+
+    // 处理 :set 选项，例如 :set autosave=30
+    void handle_set(const string& option) {
+        size_t eq = option.find('=');
+        string name = option.substr(0, eq);
+        string value = (eq != string::npos) ? option.substr(eq + 1) : "";
+        if (name == "autosave" && is_number(value)) {
+            autosave_interval = stoi(value);
+            last_autosave = chrono::steady_clock::now();
+        } else if (name == "timeoutlen" && is_number(value)) {
+            timeoutlen = stoi(value);
+        } else if ((name == "shiftwidth" || name == "sw") && is_number(value)) {
+            shiftwidth = stoi(value);
+        } else if (name == "tags" && !value.empty()) {
+            tags_path = value;
+        } else if (name == "ttimeoutlen" && is_number(value)) {
+            ttimeoutlen = stoi(value);
+            if (!headless) set_escdelay(ttimeoutlen);
+        } else if ((name == "autoread" || name == "ar" || name == "noautoread" || name == "noar") && eq == string::npos) {
+            autoread = name[0] != 'n';
+        } else if ((name == "undofile" || name == "udf" || name == "noundofile" || name == "noudf") && eq == string::npos) {
+            undofile = name[0] != 'n';
+        } else if ((name == "undodir" || name == "udir") && !value.empty()) {
+            undo_dir = value;
+        } else if (name == "undobudget" && is_number(value)) {
+            UndoTree::budget = (size_t)stoi(value) << 20;
+        } else {
+            status_message = "E518: Unknown option: " + option;
+        }
+    }
+
+    // 普通模式命令表
+    static const vector<KeyBinding>& normal_bindings() {
+        static const vector<KeyBinding> table = {
+            {{'h'}, &MiniVim::cursor_left},      {{KEY_LEFT}, &MiniVim::cursor_left},
+            {{'j'}, &MiniVim::cursor_down},      {{KEY_DOWN}, &MiniVim::cursor_down},
+            {{'k'}, &MiniVim::cursor_up},        {{KEY_UP}, &MiniVim::cursor_up},
+            {{'l'}, &MiniVim::cursor_right},     {{KEY_RIGHT}, &MiniVim::cursor_right},
+            {{'0'}, &MiniVim::line_start},       {{'$'}, &MiniVim::line_end},
+            {{'g', 'g'}, &MiniVim::goto_first_line},
+            {{'G'}, &MiniVim::goto_last_line},
+            {{'i'}, &MiniVim::enter_insert_mode},
+            {{':'}, &MiniVim::enter_command_mode},
+            {{'d', 'd'}, &MiniVim::delete_lines},
+            {{'y', 'y'}, &MiniVim::yank_lines},
+            {{'p'}, &MiniVim::paste_lines},
+            {{'u'}, &MiniVim::undo_command},
+            {{18}, &MiniVim::redo_command},  // Ctrl+r
+            {{'g', '-'}, &MiniVim::undo_older},  {{'g', '+'}, &MiniVim::undo_newer},
+            {{'v'}, &MiniVim::enter_visual_char},
+            {{'V'}, &MiniVim::enter_visual_line},
+            {{22}, &MiniVim::enter_visual_block},  // Ctrl+v
+            {{'>', '>'}, &MiniVim::indent_lines},
+            {{'<', '<'}, &MiniVim::outdent_lines},
+            {{'"'}, &MiniVim::select_register, true},
+            {{'q'}, &MiniVim::start_recording, true},
+            {{'@'}, &MiniVim::play_macro, true},
+            {{29}, &MiniVim::tag_under_cursor},  // Ctrl+]
+            {{20}, &MiniVim::pop_tag},           // Ctrl+T
+            {{23, 'w'}, &MiniVim::next_window},  {{23, 23}, &MiniVim::next_window},  // Ctrl+W
+            {{23, 's'}, &MiniVim::split_window}, {{23, 'v'}, &MiniVim::vsplit_window},
+            {{23, 'c'}, &MiniVim::close_window}, {{23, 'q'}, &MiniVim::close_window},
+            {{23, 'o'}, &MiniVim::only_window},
+            {{23, 'h'}, &MiniVim::window_left},  {{23, 'j'}, &MiniVim::window_down},
+            {{23, 'k'}, &MiniVim::window_up},    {{23, 'l'}, &MiniVim::window_right},
+            {{']', 'c'}, &MiniVim::next_change},
+            {{'[', 'c'}, &MiniVim::previous_change},
+        };
+        return table;
+    }
+
+    // 处理普通模式输入：累积计数前缀和按键序列，完整匹配命令表中的一项时执行
+    void normal_mode(int ch) {
+        // 已匹配到需要参数的命令，本按键即为参数
+        if (awaiting_argument) {
+            const KeyBinding* binding = awaiting_argument;
+            awaiting_argument = nullptr;
+            run_binding(*binding, ch);
+            return;
+        }
+        // 录制宏时按q结束录制
+        if (recording_register && ch == 'q' && !has_pending_keys() && visual_mode == VISUAL_NONE) {
+            stop_recording();
+            return;
+        }
+        // 计数前缀（单独的0是"行首"命令）
+        if (pending_keys.empty() && ch >= '0' && ch <= '9' && (ch != '0' || pending_count > 0)) {
+            pending_count = min(pending_count * 10 + (ch - '0'), 9999999);
+            pending_since = chrono::steady_clock::now();
+            return;
+        }
+        pending_keys.push_back(ch);
+        bool is_prefix = false;
+        for (const KeyBinding& binding : visual_mode != VISUAL_NONE ? visual_bindings() : normal_bindings()) {
+            if (binding.keys == pending_keys) {
+                if (binding.takes_argument) {
+                    awaiting_argument = &binding;  // 等待参数按键
+                    pending_since = chrono::steady_clock::now();
+                } else {
+                    run_binding(binding, 0);
+                }
+                return;
+            }
+            if (binding.keys.size() > pending_keys.size() &&
+                equal(pending_keys.begin(), pending_keys.end(), binding.keys.begin())) {
+                is_prefix = true;
+            }
+        }
+        if (is_prefix) {
+            pending_since = chrono::steady_clock::now();  // 等待后续按键
+        } else {
+            reset_pending_keys();  // 无效序列，丢弃
+        }
+    }
+
+    // 执行命令表中的一项，argument为参数按键
+    void run_binding(const KeyBinding& binding, int argument) {
+        int count = pending_count;
+        char reg = pending_register;
+        reset_pending_keys();
+        pending_register = reg;  // 处理函数通过take_register()取用
+        pending_argument = argument;
+        (this->*binding.handler)(count);
+        pending_register = 0;
+    }
+
+    // 清空未完成的按键序列、计数和寄存器
+    void reset_pending_keys() {
+        pending_keys.clear();
+        pending_count = 0;
+        pending_register = 0;
+        awaiting_argument = nullptr;
+    }
+
+    bool has_pending_keys() const {
+        return !pending_keys.empty() || pending_count > 0 || pending_register != 0 || awaiting_argument;
+    }
+
+    // 寄存器名是否有效：'"'或字母
+    static bool valid_register(int reg) {
+        return reg == '"' || (reg < 128 && isalpha(reg));
+    }
+
+    // "x：指定下一条命令使用的寄存器，保留已输入的计数
+    void select_register(int count) {
+        if (!valid_register(pending_argument)) return;
+        pending_count = count;
+        pending_register = pending_argument;
+        pending_since = chrono::steady_clock::now();
+    }
+
+    // q{reg}：开始把输入的按键录制到寄存器（大写寄存器名表示追加）
+    void start_recording(int) {
+        if (!valid_register(pending_argument) || pending_argument == '"') return;
+        recording_register = pending_argument;
+        recorded_keys.clear();
+    }
+
+    // 再次按q：结束录制并保存按键序列
+    void stop_recording() {
+        if (!recorded_keys.empty()) recorded_keys.pop_back();  // 去掉结束录制的q
+        char reg = tolower(recording_register);
+        auto& keys = macros[reg];
+        if (isupper(recording_register) && keys) {
+            auto joined = make_shared<vector<int>>(*keys);
+            joined->insert(joined->end(), recorded_keys.begin(), recorded_keys.end());
+            keys = joined;
+        } else {
+            keys = make_shared<vector<int>>(recorded_keys);
+        }
+        recording_register = 0;
+        recorded_keys.clear();
+    }
+
+    // [count]@{reg}：回放寄存器中的宏count次；@@ 回放上一次的宏，@: 重复上一条命令行。
+    // 回放的按键直接送入按键分发，回放结束前不重绘界面
+    void play_macro(int count) {
+        int reg = pending_argument;
+        if (reg == '@') reg = last_macro;
+        if (reg == ':') {
+            if (last_command.empty()) return;
+            auto keys = make_shared<vector<int>>();
+            keys->push_back(':');
+            keys->insert(keys->end(), last_command.begin(), last_command.end());
+            keys->push_back(10);
+            if (replay_frames.empty()) undo_group_saved = false;
+            replay_frames.push_back({keys, 0, max(count, 1)});
+            last_macro = ':';
+            return;
+        }
+        if (reg < 128 && isupper(reg)) reg = tolower(reg);
+        auto macro = macros.find(reg);
+        if (macro == macros.end() || !macro->second || macro->second->empty()) {
+            command_failed = true;
+            return;
+        }
+        if (replay_frames.size() >= 100) {  // 防止宏递归调用自身导致无限嵌套
+            status_message = "E132: Macro nesting too deep";
+            command_failed = true;
+            return;
+        }
+        last_macro = reg;
+        if (replay_frames.empty()) undo_group_saved = false;  // 新的一次回放
+        replay_frames.push_back({macro->second, 0, max(count, 1)});
+    }
+
+    // 未完成的序列超过timeoutlen毫秒没有后续按键则作废
+    void expire_pending_keys() {
+        if (has_pending_keys() && chrono::steady_clock::now() - pending_since >= chrono::milliseconds(timeoutlen)) {
+            reset_pending_keys();
+        }
+    }
+
+    // 光标移动：无法移动时标记命令失败，使宏回放在文件边界处停止
+    void cursor_left(int count) {
+        if (cursor_x == 0) command_failed = true;
+        cursor_x = max(cursor_x - max(count, 1), 0);  // 左移光标
+        adjust_window();
+    }
+
+    void cursor_down(int count) {
+        if (cursor_y + 1 >= (int)lines.size()) command_failed = true;
+        cursor_y = min(cursor_y + max(count, 1), (int)lines.size() - 1);  // 下移光标
+        adjust_window();
+    }
+
+    void cursor_up(int count) {
+        if (cursor_y == 0) command_failed = true;
+        cursor_y = max(cursor_y - max(count, 1), 0);  // 上移光标
+        adjust_window();
+    }
+
+    void cursor_right(int count) {
+        if (cursor_x >= (int)lines[cursor_y].size()) command_failed = true;
+        cursor_x = min(cursor_x + max(count, 1), (int)lines[cursor_y].size());  // 右移光标
+        adjust_window();
+    }
+
+    void line_start(int) {
+        cursor_x = 0;  // 移动到行首
+        adjust_window();
+    }
+
+    void line_end(int) {
+        if (!lines[cursor_y].empty()) {
+            cursor_x = lines[cursor_y].length() - 1;  // 移动到行尾
+        } else {
+            cursor_x = 0;
+        }
+        adjust_window();
+    }
+
+    // gg：移动到文件开头，带计数时跳到第count行
+    void goto_first_line(int count) {
+        cursor_y = count > 0 ? min(count, (int)lines.size()) - 1 : 0;
+        adjust_window();
+    }
+
+    // G：移动到文件末尾，带计数时跳到第count行
+    void goto_last_line(int count) {
+        cursor_y = count > 0 ? min(count, (int)lines.size()) - 1 : lines.size() - 1;
+        adjust_window();
+    }
+
+    void enter_insert_mode(int) {
+        insert_mode_active = true;  // 进入插入模式
+        push_undo();  // 插入期间的修改记为一步撤销
+    }
+
+    void enter_command_mode(int) {
+        command_mode_active = true;  // 进入命令模式
+        command_buffer.clear();
+    }
+
+    // 取出本条命令指定的寄存器名（未指定时为无名寄存器）
+    char take_register() {
+        char reg = pending_register ? pending_register : '"';
+        pending_register = 0;
+        return reg;
+    }
+
+    // 把一段文本存入寄存器：大写寄存器名表示追加，写命名寄存器时同时更新无名寄存器
+    void store_register(char reg, const LineBuffer& text, int type = REG_LINE) {
+        if (isupper(reg)) {
+            reg = tolower(reg);
+            Register& target = registers[reg];
+            if (target.type != type) target.type = REG_LINE;  // 类型不同的内容追加后按行处理
+            target.text.append(text);
+        } else {
+            registers[reg].text = text;
+            registers[reg].type = type;
+        }
+        if (reg != '"') registers['"'] = registers[reg];
+    }
+
+    // [count]dd：从当前行起删除count行，一次范围删除、一条撤销记录；删除的行存入寄存器
+    void delete_lines(int count) {
+        char reg = take_register();
+        if (cursor_y < lines.size()) {
+            size_t last = min(lines.size(), (size_t)cursor_y + max(count, 1));
+            size_t deleted = last - cursor_y;
+            push_undo();  // 保存删除前的整个文本状态
+            store_register(reg, lines.slice(cursor_y, last), REG_LINE);
+            lines.erase(cursor_y, last);  // 删除这些行
+            if (lines.empty()) {
+                lines.push_back("");
+            }
+            if (cursor_y >= lines.size()) {
+                cursor_y = lines.size() - 1;
+                cursor_x = min(cursor_x, (int)lines[cursor_y].size());
+            }
+            if (deleted > 2) status_message = to_string(deleted) + " fewer lines";
+        }
+        adjust_window();
     }
 
-private:
-    vector<string> file_history; // 文件历史列表
-    size_t current_file_index;   // 当前文件的索引
-    string filename;             // 当前文件名
-    vector<string> lines;        // 当前文件内容
-    int cursor_x = 0, cursor_y = 0;  // 光标位置
-    int top_line = 0, left_column = 0;  // 窗口滚动位置
-    int screen_width, screen_height;  // 屏幕尺寸
-    bool insert_mode_active;  // 插入模式是否激活
-    bool command_mode_active;  // 命令模式是否激活
-    string command_buffer;  // 命令缓冲区
-    string copied_line;  // 复制的行内容
-    stack<vector<string>> undo_stack; // 撤销栈，保存整个文本的状态
-    stack<vector<string>> redo_stack; // 重做栈，保存整个文本的状态
+    // [count]yy：复制从当前行起的count行到寄存器（共享缓冲区的块，不复制行内容）
+    void yank_lines(int count) {
+        char reg = take_register();
+        size_t last = min(lines.size(), (size_t)cursor_y + max(count, 1));
+        store_register(reg, lines.slice(cursor_y, last), REG_LINE);
+        if (last - cursor_y > 2) status_message = to_string(last - cursor_y) + " lines yanked";
+    }
 
-    // 加载当前文件
-    void loadFile() {
-        filename = file_history[current_file_index];
-        ifstream file(filename);
-        lines.clear();
-        if (file.is_open()) {
-            string line;
-            while (getline(file, line)) {
-                lines.push_back(line);
+    // [count]p：把寄存器的内容重复count次粘贴到光标之后，一次批量修改、一条撤销记录。
+    // 按行的内容粘贴到当前行下方，按字符的内容粘贴到光标后，按列的内容从光标后一列起逐行插入
+    void paste_lines(int count) {
+        auto reg = registers.find(tolower(take_register()));
+        if (reg != registers.end() && !reg->second.text.empty()) {
+            const Register& content = reg->second;
+            push_undo();  // 保存粘贴前的整个文本状态
+            if (content.type == REG_CHAR) {
+                paste_chars(content.text, max(count, 1));
+            } else if (content.type == REG_BLOCK) {
+                paste_block(content.text, max(count, 1));
+            } else {
+                LineBuffer pasted;
+                for (int i = 0; i < max(count, 1); ++i) {
+                    pasted.append(content.text);
+                }
+                size_t inserted = pasted.size();
+                lines.splice(cursor_y + 1, pasted);  // 粘贴寄存器中的行
+                ++cursor_y;
+                if (inserted > 2) status_message = to_string(inserted) + " more lines";
             }
-            file.close();
         }
-        if (lines.empty()) lines.push_back("");  
+        else {
+            string new_line = lines[cursor_y].substr(cursor_x);  // 插入新行
+            lines.mut(cursor_y).erase(cursor_x);
+            lines.insert(cursor_y + 1, new_line);
+            ++cursor_y;
+            cursor_x = 0;
+        }
+        adjust_window();
     }
 
-    // 保存当前文件
-    void saveFile() {
-        ofstream file(filename);
-        if (file.is_open()) {
-            for (const string& line : lines) {
-                file << line << endl;
+    // 粘贴按字符复制的文本：首段接在光标后，末段接上原行的剩余部分
+    void paste_chars(const LineBuffer& text, int times) {
+        vector<string> pieces(1);
+        for (int t = 0; t < times; ++t) {
+            bool first = true;
+            for (const string& part : text) {
+                if (first) pieces.back() += part; else pieces.push_back(part);
+                first = false;
             }
-            file.close();
+        }
+        size_t column = lines[cursor_y].empty() ? 0 : min((size_t)cursor_x + 1, lines[cursor_y].size());
+        string& line = lines.mut(cursor_y);
+        if (pieces.size() == 1) {
+            line.insert(column, pieces[0]);
+            cursor_x = column + pieces[0].size() - 1;
+        } else {
+            pieces.back() += line.substr(column);
+            line.erase(column);
+            line += pieces[0];
+            lines.insert(cursor_y + 1, vector<string>(make_move_iterator(pieces.begin() + 1), make_move_iterator(pieces.end())));
+            cursor_x = column;
         }
     }
 
-    // 调整窗口滚动位置以适应光标
-    void adjust_window() { 
-        // 垂直滚动
-        if (cursor_y < top_line) {
-            top_line = cursor_y;
-        } else if (cursor_y >= top_line + screen_height - 2) {
-            top_line = cursor_y - (screen_height - 3);
+    // 粘贴按列复制的文本：每一行插入到对应行的同一列，不足的行和列用空格补齐
+    void paste_block(const LineBuffer& text, int times) {
+        size_t width = 0;
+        for (const string& row : text) width = max(width, row.size());
+        size_t column = lines[cursor_y].empty() ? 0 : cursor_x + 1;
+        size_t y = cursor_y;
+        for (const string& row : text) {
+            if (y >= lines.size()) lines.push_back("");
+            string& line = lines.mut(y++);
+            if (line.size() < column) line.append(column - line.size(), ' ');
+            string piece;
+            for (int t = 0; t < times; ++t) {
+                piece += row;
+                piece.append(width - row.size(), ' ');
+            }
+            if (column >= line.size()) piece.erase(piece.find_last_not_of(' ') + 1);  // 行尾不留多余空格
+            line.insert(column, piece);
         }
+        cursor_x = column;
+    }
 
-        // 水平滚动
-        if (cursor_x < left_column) {
-            left_column = cursor_x;
-        } else if (cursor_x >= left_column + screen_width - 10) {
-            left_column = cursor_x - (screen_width - 11);
-        }
+    void undo_command(int count) {
+        for (int i = 0; i < max(count, 1); ++i) undo();  // 撤销操作
     }
 
-    // 绘制界面
-    void draw() {
-        clear();  // 清屏
-        int line_number_width = 5;  // 行号宽度
+    void redo_command(int count) {
+        for (int i = 0; i < max(count, 1); ++i) redo();  // 重做操作
+    }
 
-        // 绘制文件内容
-        for (int i = top_line; i < lines.size() && i < top_line + screen_height - 2; ++i) {
-            stringstream ss;
-            ss << setw(line_number_width) << right << (i + 1) << " | ";  // 行号
+    // 可视模式的命令表：移动命令与普通模式相同，其余为作用于选区的操作
+    static const vector<KeyBinding>& visual_bindings() {
+        static const vector<KeyBinding> table = {
+            {{'h'}, &MiniVim::cursor_left},      {{KEY_LEFT}, &MiniVim::cursor_left},
+            {{'j'}, &MiniVim::cursor_down},      {{KEY_DOWN}, &MiniVim::cursor_down},
+            {{'k'}, &MiniVim::cursor_up},        {{KEY_UP}, &MiniVim::cursor_up},
+            {{'l'}, &MiniVim::cursor_right},     {{KEY_RIGHT}, &MiniVim::cursor_right},
+            {{'0'}, &MiniVim::line_start},       {{'$'}, &MiniVim::line_end},
+            {{'g', 'g'}, &MiniVim::goto_first_line},
+            {{'G'}, &MiniVim::goto_last_line},
+            {{'v'}, &MiniVim::enter_visual_char},
+            {{'V'}, &MiniVim::enter_visual_line},
+            {{22}, &MiniVim::enter_visual_block},  // Ctrl+v
+            {{27}, &MiniVim::exit_visual},         // ESC
+            {{'o'}, &MiniVim::visual_swap_ends},
+            {{'d'}, &MiniVim::visual_delete},    {{'x'}, &MiniVim::visual_delete},
+            {{'y'}, &MiniVim::visual_yank},
+            {{'c'}, &MiniVim::visual_change},
+            {{'>'}, &MiniVim::visual_indent},
+            {{'<'}, &MiniVim::visual_outdent},
+            {{'I'}, &MiniVim::visual_block_insert},
+            {{'A'}, &MiniVim::visual_block_append},
+            {{'"'}, &MiniVim::select_register, true},
+            {{':'}, &MiniVim::visual_command},
+        };
+        return table;
+    }
 
-            string visible_text;
-            if (left_column < lines[i].length()) {
-                visible_text = lines[i].substr(left_column, screen_width - line_number_width - 3);  // 可见文本
-            } else {
-                visible_text = "";
-            }
-            mvprintw(i - top_line, 0, "%s%s", ss.str().c_str(), visible_text.c_str());  // 打印行号和文本
+    // 进入或切换可视模式；再次按下同一种可视模式的键则退出
+    void toggle_visual(int mode) {
+        if (visual_mode == mode) {
+            visual_mode = VISUAL_NONE;
+            return;
         }
+        if (visual_mode == VISUAL_NONE) {
+            visual_start_x = cursor_x;
+            visual_start_y = cursor_y;
+        }
+        visual_mode = mode;
+    }
 
-        // 确保光标位置在有效范围内
-        if (cursor_y >= lines.size()) cursor_y = lines.size() - 1;
-        cursor_x = min(cursor_x, (int)lines[cursor_y].length());
-        cursor_x = max(cursor_x, 0);
+    void enter_visual_char(int) { toggle_visual(VISUAL_CHAR); }
+    void enter_visual_line(int) { toggle_visual(VISUAL_LINE); }
+    void enter_visual_block(int) { toggle_visual(VISUAL_BLOCK); }
+    void exit_visual(int) { visual_mode = VISUAL_NONE; }
 
-        // 移动光标到正确位置
-        move(cursor_y - top_line, cursor_x - left_column + line_number_width + 3);
+    // 可视模式下按 : 进入命令行，预先填入选区的行范围 '<,'>
+    void visual_command(int) {
+        visual_mark_first = min(visual_start_y, cursor_y);
+        visual_mark_last = max(visual_start_y, cursor_y);
+        visual_mode = VISUAL_NONE;
+        enter_command_mode(0);
+        command_buffer = "'<,'>";
+    }
 
-        // 高亮光标位置
-        attron(A_STANDOUT);
-        if (cursor_x >= lines[cursor_y].length()) {
-            mvprintw(cursor_y - top_line, cursor_x - left_column + line_number_width + 3, " ");
+    // o：光标移到选区的另一端
+    void visual_swap_ends(int) {
+        swap(cursor_x, visual_start_x);
+        swap(cursor_y, visual_start_y);
+        adjust_window();
+    }
+
+    // 选区的边界：first_*为起点，last_*为终点（都包含在内）。
+    // 按列的选区中first_x/last_x为左右两列，按行的选区只使用行号。
+    // 按字符的选区两端列限制在各自行的最后一个字符上，光标停在行尾之后时也不会越界
+    void visual_bounds(int& first_y, int& first_x, int& last_y, int& last_x) const {
+        first_y = min(visual_start_y, cursor_y);
+        last_y = max(visual_start_y, cursor_y);
+        if (visual_mode == VISUAL_BLOCK) {
+            first_x = min(visual_start_x, cursor_x);
+            last_x = max(visual_start_x, cursor_x);
+        } else if (make_pair(visual_start_y, visual_start_x) <= make_pair(cursor_y, cursor_x)) {
+            first_x = visual_start_x;
+            last_x = cursor_x;
         } else {
-            mvprintw(cursor_y - top_line, cursor_x - left_column + line_number_width + 3, "%c", lines[cursor_y][cursor_x]);
+            first_x = cursor_x;
+            last_x = visual_start_x;
         }
-        attroff(A_STANDOUT);
+        if (visual_mode == VISUAL_CHAR) {
+            first_x = min<size_t>(first_x, max<size_t>(lines[first_y].size(), 1) - 1);
+            last_x = min<size_t>(last_x, max<size_t>(lines[last_y].size(), 1) - 1);
+        }
+    }
 
-        // 绘制状态栏和命令显示
-        attron(A_REVERSE);
-        mvprintw(screen_height - 2, 0, " MODE: %s | FILE: %s ", 
-            insert_mode_active ? "INSERT" : (command_mode_active ? "COMMAND" : "NORMAL"),
-            filename.c_str());
-        clrtoeol();
-        mvprintw(screen_height - 1, 0, ": %s", command_buffer.c_str());
-        clrtoeol();
-        attroff(A_REVERSE);
+    // 第row行被选中的列范围[begin, end)，没有选中时返回false
+    bool visual_columns(int row, size_t& begin, size_t& end) const {
+        int first_y, first_x, last_y, last_x;
+        visual_bounds(first_y, first_x, last_y, last_x);
+        if (row < first_y || row > last_y) return false;
+        size_t length = lines[row].size();
+        if (visual_mode == VISUAL_LINE) {
+            begin = 0;
+            end = length + 1;
+        } else if (visual_mode == VISUAL_BLOCK) {
+            begin = first_x;
+            end = last_x + 1;
+        } else {
+            begin = (row == first_y) ? first_x : 0;
+            end = (row == last_y) ? last_x + 1 : length + 1;
+        }
+        return true;
+    }
 
-        refresh();  // 刷新屏幕
+    // 取出选区内容（不修改缓冲区）
+    Register visual_text() const {
+        int first_y, first_x, last_y, last_x;
+        visual_bounds(first_y, first_x, last_y, last_x);
+        Register text;
+        if (visual_mode == VISUAL_LINE) {
+            text.text = lines.slice(first_y, last_y + 1);
+            text.type = REG_LINE;
+        } else if (visual_mode == VISUAL_BLOCK) {
+            vector<string> rows;
+            for (int i = first_y; i <= last_y; ++i) {
+                const string& line = lines[i];
+                rows.push_back((size_t)first_x < line.size() ? line.substr(first_x, last_x - first_x + 1) : "");
+            }
+            text.text.splice(0, block_from(std::move(rows)));
+            text.type = REG_BLOCK;
+        } else if (first_y == last_y) {
+            text.text.push_back(lines[first_y].substr(first_x, last_x - first_x + 1));
+            text.type = REG_CHAR;
+        } else {
+            text.text = lines.slice(first_y + 1, last_y);  // 中间的整行共享存储
+            text.text.insert(0, lines[first_y].substr(first_x));
+            text.text.push_back(lines[last_y].substr(0, last_x + 1));
+            text.type = REG_CHAR;
+        }
+        return text;
     }
 
-    // 处理搜索和替换命令
-    void handle_search_replace(const string& command) {
-        size_t first_slash = command.find('/');
-        size_t second_slash = command.find('/', first_slash + 1);
-        size_t third_slash = command.find('/', second_slash + 1);
+    static LineBuffer block_from(vector<string> rows) {
+        LineBuffer block;
+        block.insert(0, std::move(rows));
+        return block;
+    }
 
-        if (first_slash == string::npos || second_slash == string::npos) {
-            return;
+    // 删除选区：一次批量修改，调用者负责保存撤销状态。返回删除后光标应在的位置
+    void delete_visual_range(int& row, int& col) {
+        int first_y, first_x, last_y, last_x;
+        visual_bounds(first_y, first_x, last_y, last_x);
+        row = first_y;
+        col = first_x;
+        if (visual_mode == VISUAL_LINE) {
+            lines.erase(first_y, last_y + 1);
+            if (lines.empty()) lines.push_back("");
+            row = min(first_y, (int)lines.size() - 1);
+            col = 0;
+        } else if (visual_mode == VISUAL_BLOCK) {
+            // 按列批量删除：对选区内每一行删除同一列范围
+            for (int i = first_y; i <= last_y; ++i) {
+                if ((size_t)first_x < lines[i].size()) lines.mut(i).erase(first_x, last_x - first_x + 1);
+            }
+        } else {
+            string tail = (size_t)last_x + 1 < lines[last_y].size() ? lines[last_y].substr(last_x + 1) : "";
+            lines.erase(first_y + 1, last_y + 1);
+            string& head = lines.mut(first_y);
+            head.erase(first_x);
+            head += tail;
         }
+    }
 
-        string old_text = command.substr(first_slash + 1, second_slash - first_slash - 1);
-        string new_text = (third_slash != string::npos) ? command.substr(second_slash + 1, third_slash - second_slash - 1)
-                                                        : command.substr(second_slash + 1);
+    // d / x：删除选区，内容存入寄存器
+    void visual_delete(int) {
+        char reg = take_register();
+        push_undo();  // 整个选区的删除只记录一次撤销
+        Register text = visual_text();
+        store_register(reg, text.text, text.type);
+        delete_visual_range(cursor_y, cursor_x);
+        visual_mode = VISUAL_NONE;
+        adjust_window();
+    }
 
-        bool global = (third_slash != string::npos && command.substr(third_slash + 1) == "g");
+    // y：复制选区到寄存器
+    void visual_yank(int) {
+        char reg = take_register();
+        Register text = visual_text();
+        store_register(reg, text.text, text.type);
+        int first_y, first_x, last_y, last_x;
+        visual_bounds(first_y, first_x, last_y, last_x);
+        cursor_y = first_y;
+        cursor_x = visual_mode == VISUAL_LINE ? cursor_x : first_x;
+        visual_mode = VISUAL_NONE;
+        adjust_window();
+    }
 
-        string& current_line = lines[cursor_y];
-        size_t pos = 0;
+    // c：删除选区并进入插入模式；按列选区在退出插入模式时把输入复制到每一行
+    void visual_change(int) {
+        char reg = take_register();
+        push_undo();
+        Register text = visual_text();
+        store_register(reg, text.text, text.type);
+        int first_y, first_x, last_y, last_x;
+        visual_bounds(first_y, first_x, last_y, last_x);
+        int mode = visual_mode;
+        delete_visual_range(cursor_y, cursor_x);
+        if (mode == VISUAL_LINE) {
+            lines.insert(cursor_y, "");
+        } else if (mode == VISUAL_BLOCK) {
+            start_block_insert(first_y, last_y, first_x, BLOCK_CHANGE);
+        }
+        visual_mode = VISUAL_NONE;
+        insert_mode_active = true;
+        adjust_window();
+    }
+
+    // > / <：整行（按列选区为从左边界列起）缩进或取消缩进shiftwidth个空格
+    void visual_indent(int count) { visual_shift(max(count, 1)); }
+    void visual_outdent(int count) { visual_shift(-max(count, 1)); }
 
-        // 记录替换前的行内容
-        string original_line = current_line;
-        undo_stack.push(lines);  // 保存整个文本的状态
+    void visual_shift(int times) {
+        int first_y, first_x, last_y, last_x;
+        visual_bounds(first_y, first_x, last_y, last_x);
+        push_undo();
+        shift_lines(first_y, last_y, visual_mode == VISUAL_BLOCK ? first_x : 0, times);
+        cursor_y = first_y;
+        visual_mode = VISUAL_NONE;
+        adjust_window();
+    }
 
-        // 替换文本
-        while ((pos = current_line.find(old_text, pos)) != string::npos) {
-            current_line.replace(pos, old_text.length(), new_text);
-            if (!global) break;
-            pos += new_text.length();
+    // 对[first, last]行在column列处插入或删除缩进，一次遍历完成
+    void shift_lines(int first, int last, size_t column, int times) {
+        size_t width = (size_t)shiftwidth * abs(times);
+        for (int i = first; i <= last; ++i) {
+            const string& line = lines[i];
+            if (line.size() <= column) continue;  // 空行与过短的行不缩进
+            if (times > 0) {
+                lines.mut(i).insert(column, width, ' ');
+            } else {
+                size_t spaces = 0;
+                while (spaces < width && column + spaces < line.size() && line[column + spaces] == ' ') ++spaces;
+                if (spaces > 0) lines.mut(i).erase(column, spaces);
+            }
         }
+    }
+
+    // >> / <<：缩进当前行起的count行
+    void indent_lines(int count) {
+        push_undo();
+        shift_lines(cursor_y, min((int)lines.size(), cursor_y + max(count, 1)) - 1, 0, 1);
+    }
+
+    void outdent_lines(int count) {
+        push_undo();
+        shift_lines(cursor_y, min((int)lines.size(), cursor_y + max(count, 1)) - 1, 0, -1);
+    }
 
-        // 更新光标位置
-        cursor_x = min(cursor_x, (int)lines[cursor_y].length() - 1);
+    // I / A：按列选区的左侧或右侧插入，退出插入模式时把第一行输入的文本复制到选区的每一行
+    void visual_block_insert(int) {
+        if (visual_mode != VISUAL_BLOCK) return;
+        int first_y, first_x, last_y, last_x;
+        visual_bounds(first_y, first_x, last_y, last_x);
+        push_undo();
+        start_block_insert(first_y, last_y, first_x, BLOCK_INSERT);
+        visual_mode = VISUAL_NONE;
+        insert_mode_active = true;
         adjust_window();
-        draw();
     }
 
-    // 检查字符串是否为数字
-    bool is_number(const string& str) {
-        return !str.empty() && all_of(str.begin(), str.end(), ::isdigit);
+    void visual_block_append(int) {
+        if (visual_mode != VISUAL_BLOCK) return;
+        int first_y, first_x, last_y, last_x;
+        visual_bounds(first_y, first_x, last_y, last_x);
+        push_undo();
+        if (lines[first_y].size() < (size_t)last_x + 1) {
+            lines.mut(first_y).append(last_x + 1 - lines[first_y].size(), ' ');
+        }
+        start_block_insert(first_y, last_y, last_x + 1, BLOCK_APPEND);
+        visual_mode = VISUAL_NONE;
+        insert_mode_active = true;
+        adjust_window();
     }
 
-    // 处理普通模式输入
-    void normal_mode(int ch) {
-        switch (ch) {
-            case 'h':
-            case 4:
-                if (cursor_x > 0) --cursor_x;  // 左移光标
-                adjust_window();
-                break;
-            case 'j':
-            case 2:
-                if (cursor_y < lines.size() - 1) ++cursor_y;  // 下移光标
-                adjust_window();
-                break;
-            case 'k':
-            case 3:
-                if (cursor_y > 0) --cursor_y;  // 上移光标
-                adjust_window();
-                break;
-            case 'l':
-            case 5:
-                if (cursor_x <= lines[cursor_y].size()) ++cursor_x;  // 右移光标
-                adjust_window();
-                break;
-            case 'i':
-                insert_mode_active = true;  // 进入插入模式
-                undo_stack.push(lines);  // 保存进入插入模式前的整个文本状态
-                break;
-            case ':':
-                command_mode_active = true;  // 进入命令模式
-                command_buffer.clear();
-                break;
-            case '0':
-                cursor_x = 0;  // 移动到行首
-                adjust_window();
-                break;
-            case '$':
-                if (!lines[cursor_y].empty()) {
-                    cursor_x = lines[cursor_y].length() - 1;  // 移动到行尾
-                } else {
-                    cursor_x = 0;
-                }
-                adjust_window();
-                break;
-            case 'g':
-                if (getch() == 'g') {
-                    cursor_y = 0;  // 移动到文件开头
-                    adjust_window();
-                }
-                break;
-            case 'G':
-                cursor_y = lines.size() - 1;  // 移动到文件末尾
-                adjust_window();
-                break;
-            case 'd': 
-                if (getch() == 'd' && cursor_y < lines.size()) {
-                    undo_stack.push(lines);  // 保存删除前的整个文本状态
-                    lines.erase(lines.begin() + cursor_y);  // 删除当前行
-                    if (lines.empty()) {
-                        lines.push_back("");
-                    }
-                    if (cursor_y >= lines.size()) {
-                        --cursor_y;
-                        cursor_x = min(cursor_x, (int)lines[cursor_y].size());
-                    }
-                }
-                adjust_window();
-                break;
-            case 'y': 
-                if (getch() == 'y') {
-                    copied_line = lines[cursor_y];  // 复制当前行
-                }
-                break;
-            case 'p': 
-                if (!copied_line.empty()) {
-                    undo_stack.push(lines);  // 保存粘贴前的整个文本状态
-                    lines.insert(lines.begin() + cursor_y + 1, copied_line);  // 粘贴复制的行
-                    ++cursor_y;
-                }
-                else {
-                    string new_line = lines[cursor_y].substr(cursor_x);  // 插入新行
-                    lines[cursor_y] = lines[cursor_y].substr(0, cursor_x);
-                    lines.insert(lines.begin() + cursor_y + 1, new_line);
-                    ++cursor_y;
-                    cursor_x = 0;
-                    adjust_window();
-                }
-                adjust_window();
-                break;
-            case 'u': // 撤销操作
-                undo();
-                break;
-            case 18: // Ctrl+r - 重做操作
-                redo();
-                break;
-            default:
-                break;
+    // 开始按列插入。mode为BLOCK_INSERT（I：跳过没有延伸到该列的短行）、
+    // BLOCK_APPEND（A：短行用空格补齐）或BLOCK_CHANGE（c：跳过比该列短的行）
+    void start_block_insert(int first, int last, int column, int mode) {
+        block_insert_first = first;
+        block_insert_last = last;
+        block_insert_column = column;
+        block_insert_mode = mode;
+        block_insert_length = lines[first].size();
+        cursor_y = first;
+        cursor_x = min((size_t)column, lines[first].size());
+    }
+
+    // 退出插入模式时完成按列插入：把第一行新增的文本插入到其余各行的同一列。
+    // 第一行比该列短时输入从行尾开始
+    void finish_block_insert() {
+        int first = block_insert_first;
+        block_insert_first = -1;
+        if (first < 0 || cursor_y != first || (size_t)first >= lines.size()) return;
+        if (lines[first].size() <= block_insert_length) return;
+        size_t column = block_insert_column;
+        string text = lines[first].substr(min(column, block_insert_length), lines[first].size() - block_insert_length);
+        for (int i = first + 1; i <= block_insert_last && (size_t)i < lines.size(); ++i) {
+            size_t length = lines[i].size();
+            if (block_insert_mode == BLOCK_INSERT && length <= column) continue;
+            if (block_insert_mode == BLOCK_CHANGE && length < column) continue;
+            undo_tree.edit(lines, i, min(length, column), "", string(length < column ? column - length : 0, ' ') + text);
         }
     }
 
     // 处理插入模式输入
     void insert_mode(int ch) {
+        if (ch != 14 && ch != 16) completing = false;  // 其他按键结束补全，保留已补全的单词
         switch (ch) {
-            case 27:  // ESC 键，退出插入模式
+            case 27:  // ESC 键，退出插入模式，整个插入记为一步撤销
                 insert_mode_active = false;
-                undo_stack.push(lines);  // 保存退出插入模式时的整个文本状态
+                finish_block_insert();  // 按列插入时把输入复制到其余各行
+                if (replay_frames.empty() && !global_active) undo_tree.commit(lines);
+                update_keywords();
                 break;
-                case 4:
+            case 14:  // Ctrl+N，补全下一个候选
+            case 16:  // Ctrl+P，补全上一个候选
+                complete_keyword(ch == 14);
+                break;
+            case KEY_LEFT:
                 if (cursor_x > 0) --cursor_x;  // 左移光标
                 adjust_window();
                 break;
-            case 5:
+            case KEY_RIGHT:
                 if (cursor_x <= lines[cursor_y].length()) ++cursor_x;  // 右移光标
                 adjust_window();
                 break;
-            case 3:
+            case KEY_UP:
                 if (cursor_y > 0) --cursor_y;  // 上移光标
                 adjust_window();
+                update_keywords();  // 离开编辑过的行时同步关键字索引
                 break;
-            case 2:
+            case KEY_DOWN:
                 if (cursor_y < lines.size() - 1) ++cursor_y;  // 下移光标
                 adjust_window();
+                update_keywords();
                 break;
-            case 10: 
-                {
-                    string new_line = lines[cursor_y].substr(cursor_x);  // 插入新行
-                    lines[cursor_y] = lines[cursor_y].substr(0, cursor_x);
-                    lines.insert(lines.begin() + cursor_y + 1, new_line);
-                    ++cursor_y;
-                    cursor_x = 0;
-                    adjust_window();
-                }
+            case 10:  // 在光标处分行
+                undo_tree.edit(lines, cursor_y, min<size_t>(cursor_x, lines[cursor_y].size()), "", "\n");
+                ++cursor_y;
+                cursor_x = 0;
+                adjust_window();
+                update_keywords();
                 break;
-            case 7:
+            case 8:
+            case 127:
             case KEY_BACKSPACE:  // Backspace 键，删除字符
-                if (cursor_x > 0) {
-                    lines[cursor_y].erase(cursor_x - 1, 1);  // 删除字符
+                if (cursor_x > (int)lines[cursor_y].length()) {
+                    --cursor_x;  // 行尾之后没有字符可删
+                } else if (cursor_x > 0) {
+                    undo_tree.edit(lines, cursor_y, cursor_x - 1, lines[cursor_y].substr(cursor_x - 1, 1), "");  // 删除字符
                     --cursor_x;
                 } else if (cursor_y > 0) {
                     cursor_x = lines[cursor_y - 1].length();
-                    lines[cursor_y - 1] += lines[cursor_y];  // 合并行
-                    lines.erase(lines.begin() + cursor_y);
+                    undo_tree.edit(lines, cursor_y - 1, cursor_x, "\n", "");  // 合并行
                     --cursor_y;
                 }
                 adjust_window();
                 break;
             default:
-                if (cursor_x > lines[cursor_y].length()) {
-                    lines[cursor_y].append(cursor_x - lines[cursor_y].length(), ' ');  // 插入空格
+                if (ch >= 256 || (ch < 32 && ch != '\t')) break;  // 忽略其他功能键和控制字符
+                {
+                    size_t length = lines[cursor_y].length();
+                    string text((size_t)cursor_x > length ? cursor_x - length : 0, ' ');  // 光标在行尾之后时先补空格
+                    text += (char)ch;
+                    undo_tree.edit(lines, cursor_y, min<size_t>(cursor_x, length), "", text);  // 插入字符
                 }
-                lines[cursor_y].insert(cursor_x, 1, ch);  // 插入字符
                 ++cursor_x;
                 adjust_window();
                 break;
         }
     }
 
+    // 把当前文件自上次同步以来的修改同步到关键字索引（只处理改动过的行）
+    void update_keywords() {
+        if (headless || indexed_lines.version() == lines.version()) return;
+        keyword_index.update(indexed_lines, lines);
+        indexed_lines = lines;
+    }
+
+    // Ctrl+N / Ctrl+P：用关键字索引补全光标前的单词。连续按下时在候选之间按字典序前后切换，
+    // 越过第一个或最后一个候选时回到最初输入的前缀
+    void complete_keyword(bool forward) {
+        cursor_x = min(cursor_x, (int)lines[cursor_y].size());
+        if (!completing) {
+            update_keywords();
+            const string& line = lines[cursor_y];
+            int start = cursor_x;
+            while (start > 0 && KeywordIndex::is_word_char(line[start - 1])) --start;
+            completion_start = start;
+            completion_prefix = line.substr(start, cursor_x - start);
+            completion_word.clear();
+            completing = true;
+        }
+        string word;
+        if (keyword_index.next(completion_prefix, completion_word, forward, word)) {
+            completion_word = word;
+            status_message = "Keyword completion: " + word;
+        } else if (completion_word.empty()) {
+            status_message = "Pattern not found";
+            completing = false;
+            return;
+        } else {
+            completion_word.clear();
+            word = completion_prefix;
+            status_message = "Back at original";
+        }
+        undo_tree.edit(lines, cursor_y, completion_start, lines[cursor_y].substr(completion_start, cursor_x - completion_start), word);
+        cursor_x = completion_start + word.size();
+        adjust_window();
+    }
+
+    // 脚本模式下依次执行命令，空行和以"开头的注释行跳过，返回出错的命令及错误信息
+    vector<string> run_commands(const vector<string>& commands) {
+        vector<string> errors;
+        for (const string& line : commands) {
+            size_t begin = line.find_first_not_of(" \t:");
+            if (begin == string::npos || line[begin] == '"') continue;
+            string command = line.substr(begin);
+            command_failed = false;
+            execute_command(command);
+            bool failed = command_failed || (status_message.size() > 1 && status_message[0] == 'E' && isdigit(status_message[1]));
+            if (failed) errors.push_back(filename + ": " + command + ": " + status_message);
+            if (quit_requested) break;
+        }
+        return errors;
+    }
+
+    // 执行一条命令行命令（不含开头的冒号），交互模式与脚本模式共用
+    void execute_command(const string& command) {
+        status_message.clear();
+
+        // 行范围和命令名
+        size_t pos = 0;
+        ExRange range;
+        if (!parse_range(command, pos, range)) return;
+        size_t name_end = pos;
+        while (name_end < command.size() && isalpha((unsigned char)command[name_end])) ++name_end;
+        string name = command.substr(pos, name_end - pos);
+        string arg = command.substr(name_end);
+
+        if (name.empty() && arg.empty()) {
+            if (range.count > 0) {
+                cursor_y = max(0, min(range.last, (int)lines.size()) - 1);  // 跳转到指定行
+                cursor_x = min(cursor_x, (int)lines[cursor_y].size());
+                adjust_window();
+            }
+            return;
+        }
+        bool is_global = (name == "g" || name == "global" || name == "v" || name == "vglobal");
+        bool is_sort = (name == "sor" || name == "sort" || name == "uniq");
+        if ((is_global || is_sort) && range.count == 0) {
+            range.first = 1;  // :g、:sort、:uniq 默认作用于整个文件
+            range.last = lines.size();
+        }
+        if (is_delete_command(name)) {
+            if (check_range(range)) ex_delete(range, arg);
+            return;
+        } else if (name == "y" || name == "ya" || name == "yank") {
+            if (check_range(range)) ex_yank(range, arg);
+            return;
+        } else if (name == "m" || name == "mo" || name == "move" || name == "t" || name == "co" || name == "copy") {
+            if (check_range(range)) ex_move_copy(range, arg, name[0] != 'm');
+            return;
+        } else if (name == "s" || name == "su" || name == "substitute") {
+            if (check_range(range)) handle_search_replace(range.first, range.last, arg);
+            return;
+        } else if (is_global) {
+            if (check_range(range)) global_command(range, arg, name[0] == 'v');
+            return;
+        } else if (name == "uniq") {
+            if (check_range(range)) ex_uniq(range, arg);
+            return;
+        } else if (is_sort) {
+            if (check_range(range)) ex_sort(range, arg);
+            return;
+        } else if (name == "r" || name == "re" || name == "read") {
+            ex_read(range, arg);
+            return;
+        } else if (name.empty() && arg[0] == '!' && range.count > 0) {
+            if (check_range(range)) ex_filter(range, arg.substr(1));
+            return;
+        } else if (range.count > 0) {
+            status_message = "E481: No range allowed";
+            command_failed = true;
+            return;
+        }
+
+        if (command == "q") {
+            if (views.size() > 1) {
+                close_view();  // 有多个窗口时只关闭当前窗口
+            } else {
+                quit();  // 退出程序
+            }
+        } else if (command == "w") {
+            saveFile();  // 后台保存文件
+            if (headless) finish_save();  // 脚本模式下同步等待写完
+        } else if (command == "wq") {
+            saveFile();  // 保存并退出
+            finish_save();
+            if (lines.version() == saved_version) views.size() > 1 ? close_view() : quit();
+        } else if (command.rfind("set ", 0) == 0) {
+            handle_set(command.substr(4));  // 设置选项
+        } else if (command.rfind("e ", 0) == 0) {
+            file_history.push_back(command.substr(2));  // 打开新文件
+            switch_to_file(file_history.size() - 1);
+        } else if (command == "N") {
+            if (current_file_index > 0) {
+                switch_to_file(current_file_index - 1);  // 切换到上一个文件
+            } else {
+                status_message = "E164: Cannot go before first file";
+                command_failed = true;
+            }
+        } else if (command == "n") {
+            if (current_file_index < file_history.size() - 1) {
+                switch_to_file(current_file_index + 1);  // 切换到下一个文件
+            } else {
+                status_message = "E165: Cannot go beyond last file";
+                command_failed = true;
+            }
+        } else if (command == "ls" || command == "reg" || command == "registers" || command == "cl" || command == "clist") {
+            if (!headless) show_list(command);  // 列表只用于显示，脚本模式下忽略
+        } else if (name.empty() && arg[0] == '!') {
+            shell_command(arg.substr(1), true);
+        } else if (name == "ea" || name == "earlier" || name == "lat" || name == "later") {
+            undo_time_travel(arg, name[0] == 'e');
+        } else if (command == "undol" || command == "undolist") {
+            if (!headless) show_list("undolist");
+        } else if (name == "mks" || name == "mksession") {
+            make_session(arg);
+        } else if (name == "job") {
+            size_t begin = arg.find_first_not_of(' ');
+            if (begin != string::npos) {
+                shell_command(arg.substr(begin), false);
+            } else if (!headless) {
+                show_list("job");
+            }
+        } else if (name == "jobstop") {
+            size_t begin = arg.find_first_not_of(' ');
+            stop_jobs(begin == string::npos ? 0 : atoi(arg.c_str() + begin));
+        } else if (name == "bufdo" || name == "bufd" || name == "argdo" || name == "argd") {
+            buffer_do(arg, name[0] == 'b' ? file_history.size() : arg_count);
+        } else if (name == "tag" || name == "ta") {
+            size_t begin = arg.find_first_not_of(' ');
+            if (begin == string::npos) {
+                status_message = "E471: Argument required";
+                command_failed = true;
+            } else {
+                jump_to_tag(arg.substr(begin));
+            }
+        } else if (command == "tn" || command == "tnext") {
+            select_tag_match(tag_match_index + 1);
+        } else if (command == "tp" || command == "tprevious" || command == "tN" || command == "tNext") {
+            select_tag_match(tag_match_index - 1);
+        } else if (command == "po" || command == "pop") {
+            pop_tag(0);
+        } else if (name == "files") {
+            size_t begin = arg.find_first_not_of(' ', arg.empty() || arg[0] != '!' ? 0 : 1);
+            find_file(begin == string::npos ? "" : arg.substr(begin), !arg.empty() && arg[0] == '!');
+        } else if (name == "sp" || name == "split" || name == "vs" || name == "vsplit") {
+            size_t begin = arg.find_first_not_of(' ');
+            split_view(name[0] == 'v', begin == string::npos ? "" : arg.substr(begin));
+        } else if (name == "clo" || name == "close") {
+            close_view();
+        } else if (name == "on" || name == "only") {
+            only_view();
+        } else if (name == "diffthis") {
+            diff_this();
+        } else if (name == "diffupdate" || name == "diffu") {
+            diff_update();
+        } else if (name == "diffoff") {
+            diff_off();
+        } else if (name == "mktags") {
+            make_tags(arg);
+        } else if (name == "vimgrep" || name == "vim") {
+            vimgrep(arg);
+        } else if (command == "cn" || command == "cnext") {
+            quickfix_jump(quickfix_index + 1);
+        } else if (command == "cp" || command == "cprevious" || command == "cN" || command == "cNext") {
+            quickfix_jump(quickfix_index - 1);
+        } else if (name == "cc") {
+            size_t pos = arg.find_first_not_of(' ');
+            quickfix_jump(pos == string::npos ? quickfix_index : strtoul(arg.c_str() + pos, nullptr, 10) - 1);
+        } else if (command.rfind("b ", 0) == 0) {
+            string buffer_number_str = command.substr(2);
+            if (is_number(buffer_number_str)) {
+                size_t buffer_number = stoi(buffer_number_str) - 1;
+                if (buffer_number < file_history.size()) {
+                    switch_to_file(buffer_number);  // 切换到指定缓冲区
+                }
+            }
+        } else {
+            status_message = "E492: Not an editor command: " + command;
+            command_failed = true;
+        }
+    }
+
+    // 全屏显示 :ls 的文件列表、:reg 的寄存器列表、:clist 的quickfix列表或 :bufdo 的结果，按任意键返回
+    void show_list(const string& command) {
+        clear();
+        if (command == "ls") {
+            for (size_t i = 0; i < file_history.size(); ++i) {
+                mvprintw(i, 0, "%zu: %s", i + 1, file_history[i].c_str());  // 列出所有文件
+            }
+        } else if (command == "bufdo") {
+            int row = 0;
+            for (const string& line : bufdo_summary) {
+                if (row >= screen_height - 2) break;
+                mvprintw(row++, 0, "%s", line.c_str());  // 每个文件的执行结果
+            }
+            mvprintw(row, 0, "%s", status_message.c_str());
+        } else if (command == "job") {
+            for (size_t i = 0; i < jobs.size() && (int)i < screen_height - 1; ++i) {
+                const Job& job = *jobs[i];
+                mvprintw(i, 0, "[%d] pid %d  %zuL  %s", job.id, (int)job.pid, job.received, job.command.c_str());  // 列出运行中的命令
+            }
+            if (jobs.empty()) mvprintw(0, 0, "No jobs");
+        } else if (command == "undolist") {
+            undo_tree.commit(lines);
+            vector<UndoTree::Leaf> leaves = undo_tree.leaves();
+            mvprintw(0, 0, leaves.empty() ? "Nothing to undo" : "number changes  when");
+            int row = 1;
+            for (size_t i = leaves.size() > (size_t)screen_height - 2 ? leaves.size() - (screen_height - 2) : 0; i < leaves.size(); ++i) {
+                mvprintw(row++, 0, "%6ld %7zu  %s", leaves[i].seq, leaves[i].changes, describe_time(leaves[i].time).c_str());  // 各分支的末端
+            }
+        } else if (command == "cl" || command == "clist") {
+            for (size_t i = 0; i < quickfix.size() && (int)i < screen_height - 1; ++i) {
+                const QuickfixEntry& entry = quickfix[i];
+                mvprintw(i, 0, "%c%zu %s:%d col %d: %s", i == quickfix_index ? '>' : ' ', i + 1, entry.filename.c_str(),
+                         entry.line + 1, entry.column + 1, entry.text.c_str());  // 列出quickfix列表
+            }
+        } else {
+            int row = 0;
+            for (const auto& reg : registers) {
+                const LineBuffer& text = reg.second.text;
+                if (text.empty() || row >= screen_height - 1) continue;
+                mvprintw(row++, 0, "\"%c  %c  %zuL  %s", reg.first, "lcb"[reg.second.type], text.size(), text[0].c_str());  // 列出寄存器内容
+            }
+        }
+        refresh();
+        next_key(); // 等待用户按任意键
+        screen_stale = true;
+    }
+
     // 处理命令模式输入
     void command_mode(int ch) {
         if (ch == 27) {
@@ -360,121 +6287,196 @@ private:
             return;
         }
         if (ch == 10) {
-            if (command_buffer == "q") {
-                endwin();
-                exit(0);  // 退出程序
-            } else if (command_buffer == "w") {
-                saveFile();  // 保存文件
-            } else if (command_buffer == "wq") {
-                saveFile();  // 保存并退出
-                endwin();
-                exit(0);
-            } else if (command_buffer.rfind("s/", 0) == 0) {
-                handle_search_replace(command_buffer);  // 处理搜索替换
-            } else if (is_number(command_buffer)) {
-                int target_line = stoi(command_buffer);
-                if (target_line >= 1 && target_line <= lines.size()) {
-                    cursor_y = target_line - 1;  // 跳转到指定行
-                    adjust_window();
-                    cursor_x = min(cursor_x, (int)lines[cursor_y].size());
-                }
-            } else if (command_buffer.rfind("e ", 0) == 0) {
-                string new_filename = command_buffer.substr(2);
-                file_history.push_back(new_filename);  // 打开新文件
-                current_file_index = file_history.size() - 1;
-                loadFile();
-                cursor_x = 0;
-                cursor_y = 0;
-                top_line = 0;
-                left_column = 0;
-            } else if (command_buffer == "N") {
-                if (current_file_index > 0) {
-                    --current_file_index;  // 切换到上一个文件
-                    loadFile();
-                    cursor_x = 0;
-                    cursor_y = 0;
-                    top_line = 0;
-                    left_column = 0;
-                }
-            } else if (command_buffer == "n") {
-                if (current_file_index < file_history.size() - 1) {
-                    ++current_file_index;  // 切换到下一个文件
-                    loadFile();
-                    cursor_x = 0;
-                    cursor_y = 0;
-                    top_line = 0;
-                    left_column = 0;
-                }
-            } else if (command_buffer == "ls") {
-                clear();
-                for (size_t i = 0; i < file_history.size(); ++i) {
-                    mvprintw(i, 0, "%zu: %s", i + 1, file_history[i].c_str());  // 列出所有文件
-                }
-                refresh();
-                getch(); // 等待用户按任意键
-            } else if (command_buffer.rfind("b ", 0) == 0) {
-                string buffer_number_str = command_buffer.substr(2);
-                if (is_number(buffer_number_str)) {
-                    size_t buffer_number = stoi(buffer_number_str) - 1;
-                    if (buffer_number < file_history.size()) {
-                        current_file_index = buffer_number;  // 切换到指定缓冲区
-                        loadFile();
-                        cursor_x = 0;
-                        cursor_y = 0;
-                        top_line = 0;
-                        left_column = 0;
-                    }
-                }
-            }
+            last_command = command_buffer;
+            execute_command(command_buffer);
             command_buffer.clear();
             command_mode_active = false;
             return;
         }
-        if (ch == 7 || ch == KEY_BACKSPACE) {
+        if (ch == 8 || ch == 127 || ch == KEY_BACKSPACE) {
             if (!command_buffer.empty()) {
                 command_buffer.pop_back();  // 删除命令缓冲区中的字符
             }
             return;
         }
+        if (ch >= 256 || ch < 32) return;  // 忽略功能键和控制字符
         command_buffer += ch;  // 添加字符到命令缓冲区
     }
 
-    // 撤销操作
+    // 修改缓冲区前保存撤销状态。宏回放和:g执行期间只在第一次修改前保存，
+    // 整个回放或:g作为一步撤销（与vim相同），其中的每次修改不再各自保留一份快照
+    void push_undo() {
+        if (!replay_frames.empty() || global_active) {
+            if (undo_group_saved) return;
+            undo_group_saved = true;
+        }
+        undo_tree.checkpoint(lines);  // 记下此前的修改，接下来的修改成为新的一步
+    }
+
+    // 撤销操作。回到最初的文本之后读入撤销文件中更早的历史（只读一次）
     void undo() {
-        if (!undo_stack.empty()) {
-            redo_stack.push(lines);  // 保存当前状态到重做栈
-            lines = undo_stack.top();  // 恢复到撤销栈中的状态
-            undo_stack.pop();
-            adjust_window();
-            draw();
+        detach_read_jobs();
+        undo_tree.commit(lines);
+        if (undo_tree.at_root() && !undo_file_read && undofile && !headless) {
+            undo_file_read = true;
+            string path = undo_file_path(filename);
+            stack<LineBuffer> older;
+            if (!path.empty() && UndoFile::load(path, lines, older)) {
+                status_message = "Read " + to_string(older.size()) + " older changes from the undo file";
+                undo_tree.prepend(std::move(older));
+            }
         }
+        if (undo_tree.undo(lines)) adjust_window();
     }
 
-    // 重做操作
+    // 重做操作：沿最近一次撤销（或修改）的分支前进
     void redo() {
-        if (!redo_stack.empty()) {
-            undo_stack.push(lines);  // 保存当前状态到撤销栈
-            lines = redo_stack.top();  // 恢复到重做栈中的状态
-            redo_stack.pop();
-            adjust_window();
-            draw();
+        detach_read_jobs();
+        if (undo_tree.redo(lines)) adjust_window();
+    }
+
+    // 转到编号为seq的修改之后的状态（g- / g+、:earlier / :later），状态栏显示编号和修改时间
+    void undo_jump(long seq) {
+        seq = max(0L, min(seq, undo_tree.last_seq()));
+        detach_read_jobs();
+        if (!undo_tree.jump(seq, lines)) return;
+        adjust_window();
+        status_message = seq == 0 ? "Original text" : "#" + to_string(seq) + "  " + describe_time(undo_tree.time_of(seq));
+    }
+
+    // 修改时间的显示：100秒以内显示几秒之前，否则显示时刻（不是今天的加上日期）
+    static string describe_time(time_t when) {
+        if (when == 0) return "unknown";
+        time_t now = ::time(nullptr);
+        if (now - when < 100) return to_string(now - when) + " seconds ago";
+        struct tm then, today;
+        localtime_r(&when, &then);
+        localtime_r(&now, &today);
+        char text[32];
+        strftime(text, sizeof(text), then.tm_yday == today.tm_yday && then.tm_year == today.tm_year ? "%H:%M:%S" : "%Y/%m/%d %H:%M:%S", &then);
+        return text;
+    }
+
+    // :earlier / :later [N]、[N]s / m / h / d：按修改次数或时间在撤销树中后退或前进
+    void undo_time_travel(const string& arg, bool back) {
+        size_t begin = arg.find_first_not_of(' ');
+        string count = begin == string::npos ? "" : arg.substr(begin);
+        long amount = 1;
+        char unit = 0;
+        if (!count.empty()) {
+            size_t digits = 0;
+            while (digits < count.size() && isdigit((unsigned char)count[digits])) ++digits;
+            if (digits == 0 || digits + 1 < count.size() || (digits < count.size() && !strchr("smhd", count[digits]))) {
+                status_message = "E475: Invalid argument: " + count;
+                command_failed = true;
+                return;
+            }
+            amount = stol(count.substr(0, digits));
+            unit = digits < count.size() ? count[digits] : 0;
         }
+        undo_tree.commit(lines);
+        long seq = undo_tree.current_seq();
+        if (!unit) {
+            undo_jump(back ? seq - amount : seq + amount);
+            return;
+        }
+        long seconds = amount * (unit == 's' ? 1 : unit == 'm' ? 60 : unit == 'h' ? 3600 : 86400);
+        time_t now = undo_tree.time_of(seq);
+        if (back) {
+            long target = undo_tree.seq_at(now - seconds);
+            undo_jump(target < seq ? target : seq - 1);  // 至少后退一步
+        } else {
+            undo_jump(max(undo_tree.seq_at(now + seconds), seq));
+        }
+    }
+
+    void undo_older(int count) {
+        undo_tree.commit(lines);
+        undo_jump(undo_tree.current_seq() - max(count, 1));
+    }
+
+    void undo_newer(int count) {
+        undo_tree.commit(lines);
+        undo_jump(undo_tree.current_seq() + max(count, 1));
     }
 };
 
 // 主函数
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s <file1> <file2> ... <fileN>\n", argv[0]);
-        return 1;
-    }
-
     vector<string> filenames;
+    string script;         // -s 指定的命令脚本
+    bool headless = false; // -s 或 -es：不进入界面，只执行脚本
+    size_t jobs = 0;       // -j 指定的并行线程数，0表示按CPU核数
+    bool diff_mode = false; // -d：比较前两个文件
+    bool restore = false;   // -S：恢复会话
+    string session_file = ".minivim-session";  // -S 指定的会话文件
+    bool server = false;    // --server：接受 --remote 的请求
+    bool remote = false;    // --remote：交给正在运行的服务器打开
+    string server_path = MiniVim::default_server_path();  // --servername 指定的套接字
     for (int i = 1; i < argc; ++i) {
-        filenames.push_back(argv[i]);  // 获取命令行参数中的文件名
+        string arg = argv[i];
+        if (arg == "-S") {
+            restore = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-') session_file = argv[++i];
+        } else if (arg == "--server") {
+            server = true;
+        } else if (arg == "--remote") {
+            remote = true;
+        } else if (arg == "--servername" && i + 1 < argc) {
+            server_path = argv[++i];
+        } else if (arg == "-s" && i + 1 < argc) {
+            script = argv[++i];
+            headless = true;
+        } else if (arg == "-es") {
+            headless = true;
+        } else if (arg == "-d") {
+            diff_mode = true;
+        } else if (arg == "-j" && i + 1 < argc) {
+            jobs = strtoul(argv[++i], nullptr, 10);
+        } else {
+            filenames.push_back(arg);  // 获取命令行参数中的文件名
+        }
+    }
+    if ((filenames.empty() && !restore) || (diff_mode && (filenames.size() < 2 || headless))) {
+        printf("Usage: %s [-s script | -es] [-j jobs] <file1> <file2> ... <fileN>\n", argv[0]);
+        printf("       %s -d <file1> <file2>\n", argv[0]);
+        printf("       %s [--server | --remote] [--servername socket] <file1> ... <fileN>\n", argv[0]);
+        printf("       %s -S [session] [file ...]\n", argv[0]);
+        return 2;
+    }
+    // 有服务器在运行时由它打开文件，客户端不初始化界面也不读文件；没有服务器时在本进程中打开
+    if (remote && !headless && MiniVim::remote_open(server_path, filenames)) return 0;
+
+    if (headless) {
+        // 读取命令脚本：-s 指定的文件，否则为标准输入
+        vector<string> commands;
+        ifstream script_file;
+        if (!script.empty()) {
+            script_file.open(script);
+            if (!script_file.is_open()) {
+                fprintf(stderr, "Can't open script: %s\n", script.c_str());
+                return 2;
+            }
+        }
+        istream& in = script.empty() ? cin : script_file;
+        string line;
+        while (getline(in, line)) {
+            commands.push_back(line);
+        }
+        return MiniVim::run_script(filenames, commands, jobs);
+    }
+
+    MiniVim editor(restore ? vector<string>() : filenames);  // 创建MiniVim对象
+    if (restore && !editor.load_session(session_file, filenames)) {
+        fprintf(stderr, "Can't read session: %s\n", session_file.c_str());
+        return 1;
+    }
+    if (server && !editor.start_server(server_path)) {
+        fprintf(stderr, "Can't start server on %s (already running?)\n", server_path.c_str());
+        return 1;
     }
-    MiniVim editor(filenames);  // 创建MiniVim对象
     editor.init();  // 初始化
+    if (diff_mode) editor.start_diff();
     editor.run();  // 运行
     return 0;
-}
\ No newline at end of file
+}